@@ -0,0 +1,188 @@
+#include "buffer_pool.hpp"
+#include <atomic>
+#include <cstring>
+
+namespace buffer_pool
+{
+  static const int    CLASSES = 5;
+  static const size_t class_size[CLASSES]  = {512, 2048, 8192, 32768, 65536};
+  // at most ~4 MB kept per CPU
+  static const size_t class_limit[CLASSES] = {1024, 512, 128, 32, 16};
+  // room for the shared_ptr control block inside each node
+  static const size_t CONTROL_SIZE = 64;
+
+  struct node_t
+  {
+    alignas(16) char control[CONTROL_SIZE];
+    std::vector<uint8_t> data;
+    node_t* next = nullptr;
+    int     cpu;
+  };
+
+  struct alignas(SMP_ALIGN) pool_t
+  {
+    node_t* free[CLASSES] = {};
+    size_t  count[CLASSES] = {};
+    stats_t stats;
+    // nodes freed by other CPUs, reclaimed by the owner in one swap
+    alignas(SMP_ALIGN) std::atomic<node_t*> remote {nullptr};
+  };
+  static SMP_ARRAY<pool_t> pools;
+
+  static void release(node_t*);
+
+  /**
+   * Places the shared_ptr control block inside the node itself, and
+   * recycles the node when the control block goes away. That is the
+   * very last access shared_ptr makes, so the node is free to be reused.
+  **/
+  template <typename T>
+  struct node_allocator
+  {
+    using value_type = T;
+    node_t* node;
+
+    explicit node_allocator(node_t* n) noexcept : node(n) {}
+    template <typename U>
+    node_allocator(const node_allocator<U>& other) noexcept : node(other.node) {}
+
+    T* allocate(size_t n)
+    {
+      static_assert(sizeof(T) <= CONTROL_SIZE, "Control block does not fit in node");
+      assert(n == 1); (void) n;
+      return reinterpret_cast<T*>(node->control);
+    }
+    void deallocate(T*, size_t) noexcept
+    {
+      release(node);
+    }
+    template <typename U>
+    bool operator== (const node_allocator<U>& other) const noexcept {
+      return node == other.node;
+    }
+    template <typename U>
+    bool operator!= (const node_allocator<U>& other) const noexcept {
+      return node != other.node;
+    }
+  };
+
+  static inline int class_for(size_t capacity) noexcept
+  {
+    for (int cls = 0; cls < CLASSES; cls++)
+      if (capacity <= class_size[cls]) return cls;
+    return -1;
+  }
+
+  // the largest class a (possibly grown) buffer still satisfies
+  static inline int class_of(size_t capacity) noexcept
+  {
+    if (capacity > 2 * class_size[CLASSES-1]) return -1;
+    for (int cls = CLASSES-1; cls >= 0; cls--)
+      if (capacity >= class_size[cls]) return cls;
+    return -1;
+  }
+
+  static void put_local(pool_t& pool, node_t* node)
+  {
+    node->data.clear();
+    const int cls = class_of(node->data.capacity());
+    if (cls < 0 || pool.count[cls] >= class_limit[cls])
+    {
+      pool.stats.heap_frees++;
+      delete node;
+      return;
+    }
+    node->next = pool.free[cls];
+    pool.free[cls] = node;
+    pool.count[cls]++;
+  }
+
+  static void release(node_t* node)
+  {
+    const int cpu = SMP::cpu_id();
+    if (node->cpu == cpu)
+    {
+      pools[cpu].stats.local_frees++;
+      put_local(pools[cpu], node);
+      return;
+    }
+    pools[cpu].stats.remote_frees++;
+    auto& remote = pools[node->cpu].remote;
+    node_t* head = remote.load(std::memory_order_relaxed);
+    do {
+      node->next = head;
+    } while (not remote.compare_exchange_weak(head, node,
+                      std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  static void reclaim(pool_t& pool)
+  {
+    // only the owner takes from the stack, and it takes all of it
+    node_t* list = pool.remote.exchange(nullptr, std::memory_order_acquire);
+    while (list != nullptr)
+    {
+      node_t* next = list->next;
+      put_local(pool, list);
+      list = next;
+    }
+  }
+
+  buffer_t get(size_t capacity)
+  {
+    const int cls = class_for(capacity);
+    auto& pool = PER_CPU(pools);
+    if (cls < 0)
+    {
+      pool.stats.misses++;
+      auto buf = net::Stream::construct_buffer();
+      buf->reserve(capacity);
+      return buf;
+    }
+
+    if (pool.free[cls] == nullptr) reclaim(pool);
+
+    node_t* node = pool.free[cls];
+    if (node != nullptr)
+    {
+      pool.free[cls] = node->next;
+      pool.count[cls]--;
+      pool.stats.hits++;
+    }
+    else
+    {
+      node = new node_t;
+      node->cpu = SMP::cpu_id();
+      node->data.reserve(class_size[cls]);
+      pool.stats.misses++;
+    }
+    // the vector is owned by the node, so the deleter does nothing
+    return buffer_t(&node->data, [] (std::vector<uint8_t>*) {},
+                    node_allocator<node_t>(node));
+  }
+
+  buffer_t copy(const void* data, size_t len)
+  {
+    auto buf = get(len);
+    auto* bytes = (const uint8_t*) data;
+    buf->insert(buf->end(), bytes, bytes + len);
+    return buf;
+  }
+
+  const stats_t& get_stats(int cpu)
+  {
+    return pools.at(cpu).stats;
+  }
+
+  void print_stats()
+  {
+    for (int cpu = 0; cpu < SMP::cpu_count(); cpu++)
+    {
+      const auto& st = pools[cpu].stats;
+      printf("Buffer pool CPU %d: %llu hits %llu misses %llu local frees"
+             " %llu remote frees %llu heap frees\n", cpu,
+             (unsigned long long) st.hits, (unsigned long long) st.misses,
+             (unsigned long long) st.local_frees, (unsigned long long) st.remote_frees,
+             (unsigned long long) st.heap_frees);
+    }
+  }
+}
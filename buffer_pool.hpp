@@ -0,0 +1,48 @@
+#pragma once
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <net/stream.hpp>
+#include <smp>
+
+/**
+ * Per-CPU, size-classed pool of net::Stream buffers.
+ *
+ * Buffers are ordinary buffer_t (shared vectors), but both the vector
+ * and the shared control block are recycled into the pool of the CPU that
+ * allocated them. A buffer released on another CPU is pushed onto the
+ * owners lock-free return stack, which the owner reclaims in one swap
+ * the next time it runs short, so cross-CPU frees never touch the heap.
+**/
+namespace buffer_pool
+{
+  using buffer_t = net::Stream::buffer_t;
+
+  struct alignas(SMP_ALIGN) stats_t
+  {
+    uint64_t hits = 0;          // served from the pool
+    uint64_t misses = 0;        // new buffer from the heap
+    uint64_t local_frees = 0;
+    uint64_t remote_frees = 0;  // returned by another CPU
+    uint64_t heap_frees = 0;    // pool was full or buffer too large
+  };
+
+  /** An empty buffer with room for at least @capacity bytes */
+  buffer_t get(size_t capacity);
+
+  /** A buffer holding a copy of @len bytes from @data */
+  buffer_t copy(const void* data, size_t len);
+
+  /** A buffer of @len (zeroed) bytes */
+  inline buffer_t construct(size_t len)
+  {
+    auto buf = get(len);
+    buf->resize(len);
+    return buf;
+  }
+
+  const stats_t& get_stats(int cpu);
+  void print_stats();
+}
+
+#endif
@@ -2,3 +2,6 @@
 openssl req -newkey rsa:4096 -nodes -sha512 -x509 -days 3650 -nodes -out test.pem -keyout test.key
 openssl x509 -outform der -in test.pem -out test.der
 openssl req -newkey rsa:4096 -nodes -sha512 -x509 -days 3650 -nodes -keyout server.key
+# ECDSA P-256 profile, much cheaper to sign with than RSA-4096
+openssl ecparam -name prime256v1 -genkey -noout | openssl pkcs8 -topk8 -nocrypt -out ecdsa.key
+openssl req -new -x509 -sha256 -days 3650 -key ecdsa.key -subj "/CN=blabla" -out ecdsa.pem
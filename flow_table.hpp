@@ -0,0 +1,290 @@
+#pragma once
+#ifndef FLOW_TABLE_HPP
+#define FLOW_TABLE_HPP
+
+#include <net/tcp/connection.hpp>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+/**
+ * Open-addressing flow table mapping TCP 4-tuples to a CPU.
+ *
+ * Entries are 16 bytes and packed four to a cache line, so a lookup
+ * touches at most PROBE_BUCKETS cache lines. Every packet of a flow
+ * refreshes it. A flow that has only seen its first packet (a SYN) is
+ * kept for as long as one that is closing, TIME_WAIT after its last
+ * packet. An established flow stays until its RST, or until it has
+ * been idle for longer than TCP keepalive would let it be.
+ *
+ * When the probe window is full, expired flows make room, then the
+ * opening or closing flow that has waited longest. Established flows
+ * are never evicted, since moving one to another CPU would reset it.
+ * Instead the table doubles, up to its limit. Past that, new flows are
+ * refused until old ones expire.
+ *
+ * The table has a single owner (the BSP classifier) and is not
+ * meant to be touched from other CPUs.
+**/
+class Flow_table
+{
+public:
+  using Tuple = net::tcp::Connection::Tuple;
+  static const int BUCKET_ENTRIES = 4;
+  static const int PROBE_BUCKETS  = 2;
+
+  enum state_t : uint8_t {
+    EMPTY   = 0,
+    ACTIVE  = 1,
+    CLOSING = 2, // FIN seen, kept until TIME_WAIT expires
+    OPENING = 3  // only the first packet seen
+  };
+
+  struct stats_t {
+    uint64_t lookups   = 0;
+    uint64_t misses    = 0;
+    uint64_t inserts   = 0;
+    uint64_t removals  = 0;
+    uint64_t expired   = 0;
+    uint64_t evictions = 0;  // opening or closing flows, before they expired
+    uint64_t grows     = 0;
+    uint64_t drops     = 0;  // new flows refused at the size limit
+  };
+
+  /**
+   * @param buckets      Number of 64-byte buckets to start with,
+   *                     rounded up to a power of two
+   * @param max_buckets  The most buckets the table grows to
+   * @param idle         Seconds an established flow is kept without traffic
+   * @param time_wait    Seconds an opening or closing flow is kept
+   *                     without traffic
+   */
+  Flow_table(uint32_t buckets, uint32_t max_buckets, uint16_t idle, uint16_t time_wait)
+    : idle_{idle}, time_wait_{time_wait}
+  {
+    uint32_t n = 1;
+    while (n < buckets) n <<= 1;
+    max_buckets_ = n;
+    while (max_buckets_ < max_buckets) max_buckets_ <<= 1;
+    allocate(n);
+  }
+
+  /** Returns the CPU of an existing flow, or -1 */
+  int lookup(const Tuple& tuple, uint16_t now)
+  {
+    stats_.lookups++;
+    const key_t key = make_key(tuple);
+    const uint32_t home = hash(key) & mask_;
+    for (int b = 0; b < PROBE_BUCKETS; b++)
+    {
+      auto& bucket = table_[(home + b) & mask_];
+      for (auto& e : bucket.entry)
+      {
+        if (e.state == EMPTY || !(e.key == key)) continue;
+        if (is_expired(e, now)) {
+          e.state = EMPTY;
+          stats_.expired++;
+          continue;
+        }
+        // the flow answered, and it lives as long as it has traffic
+        if (e.state == OPENING) e.state = ACTIVE;
+        e.stamp = now;
+        return e.cpu;
+      }
+    }
+    stats_.misses++;
+    return -1;
+  }
+
+  /**
+   * Assign @cpu to a new flow, making room for it if needed.
+   * Returns false when the table is full of established flows.
+   */
+  bool insert(const Tuple& tuple, int cpu, uint16_t now)
+  {
+    const key_t key = make_key(tuple);
+    // the flow itself may be anywhere in the window
+    entry_t* victim = find(key);
+    if (victim == nullptr) victim = make_room(key, now);
+    while (victim == nullptr && grow(now))
+      victim = make_room(key, now);
+    if (victim == nullptr) {
+      stats_.drops++;
+      return false;
+    }
+    stats_.inserts++;
+    victim->key   = key;
+    victim->cpu   = cpu;
+    victim->state = OPENING;
+    victim->stamp = now;
+    return true;
+  }
+
+  /** Remove a flow immediately (RST) */
+  void erase(const Tuple& tuple)
+  {
+    if (auto* e = find(make_key(tuple))) {
+      e->state = EMPTY;
+      stats_.removals++;
+    }
+  }
+
+  /** Keep the flow routable until TIME_WAIT has passed (FIN) */
+  void closing(const Tuple& tuple, uint16_t now)
+  {
+    if (auto* e = find(make_key(tuple))) {
+      if (e->state == ACTIVE) {
+        e->state = CLOSING;
+        e->stamp = now;
+      }
+    }
+  }
+
+  size_t capacity() const noexcept {
+    return (mask_ + 1) * BUCKET_ENTRIES;
+  }
+  size_t memory_usage() const noexcept {
+    return (mask_ + 1) * sizeof(bucket_t);
+  }
+  const stats_t& stats() const noexcept { return stats_; }
+
+private:
+  struct key_t {
+    uint32_t laddr;
+    uint32_t raddr;
+    uint16_t lport;
+    uint16_t rport;
+    bool operator== (const key_t& k) const noexcept {
+      return laddr == k.laddr && raddr == k.raddr
+          && lport == k.lport && rport == k.rport;
+    }
+  };
+  struct entry_t {
+    key_t    key;
+    uint8_t  cpu;
+    state_t  state;
+    uint16_t stamp; // seconds, wrapping
+  };
+  struct alignas(64) bucket_t {
+    entry_t entry[BUCKET_ENTRIES];
+  };
+  static_assert(sizeof(entry_t) == 16, "Flow entries must be 16 bytes");
+  static_assert(sizeof(bucket_t) == 64, "Flow buckets must fill one cache line");
+
+  static key_t make_key(const Tuple& tuple) noexcept {
+    return { tuple.first.address().whole, tuple.second.address().whole,
+             tuple.first.port(), tuple.second.port() };
+  }
+  static uint32_t hash(const key_t& key) noexcept
+  {
+    uint64_t h = ((uint64_t) key.raddr << 32) | key.laddr;
+    h ^= ((uint64_t) key.rport << 16 | key.lport) * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 31;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 29;
+    return (uint32_t) h;
+  }
+  // seconds since the last packet, against the limit for the state
+  bool is_expired(const entry_t& e, uint16_t now) const noexcept {
+    const uint16_t age = now - e.stamp;
+    return age >= ((e.state == ACTIVE) ? idle_ : time_wait_);
+  }
+  void allocate(uint32_t n)
+  {
+    mask_ = n - 1;
+    table_.reset(new bucket_t[n]);
+    std::memset(table_.get(), 0, n * sizeof(bucket_t));
+  }
+  /**
+   * A slot for @key in its window: an empty or expired one, or else
+   * the opening or closing flow that has waited longest. Never an
+   * established flow.
+   */
+  entry_t* make_room(const key_t& key, uint16_t now)
+  {
+    entry_t* victim = nullptr;
+    const uint32_t home = hash(key) & mask_;
+    for (int b = 0; b < PROBE_BUCKETS; b++)
+    {
+      auto& bucket = table_[(home + b) & mask_];
+      for (auto& e : bucket.entry)
+      {
+        if (e.state == EMPTY) return &e;
+        if (is_expired(e, now)) {
+          stats_.expired++;
+          return &e;
+        }
+        if (e.state != ACTIVE &&
+            (victim == nullptr || (uint16_t) (now - e.stamp) > (uint16_t) (now - victim->stamp)))
+            victim = &e;
+      }
+    }
+    if (victim) stats_.evictions++;
+    return victim;
+  }
+  /**
+   * Twice the buckets, or more when a window overflows while
+   * rehashing, up to the limit. At the limit the table stays as it is.
+   */
+  bool grow(uint16_t now)
+  {
+    const uint32_t old_n = mask_ + 1;
+    if (old_n >= max_buckets_) return false;
+    std::unique_ptr<bucket_t[]> old = std::move(table_);
+    for (uint32_t n = old_n << 1; n <= max_buckets_; n <<= 1)
+    {
+      allocate(n);
+      if (rehash(old.get(), old_n, now)) {
+        stats_.grows++;
+        return true;
+      }
+    }
+    table_ = std::move(old);
+    mask_  = old_n - 1;
+    return false;
+  }
+  // the live flows of @old into the (empty) table, false if one has no room
+  bool rehash(const bucket_t* old, uint32_t old_n, uint16_t now) noexcept
+  {
+    for (uint32_t i = 0; i < old_n; i++)
+    for (const auto& e : old[i].entry)
+    {
+      if (e.state == EMPTY || is_expired(e, now)) continue;
+      entry_t* slot = find_empty(e.key);
+      if (slot == nullptr) return false;
+      *slot = e;
+    }
+    return true;
+  }
+  entry_t* find_empty(const key_t& key) noexcept
+  {
+    const uint32_t home = hash(key) & mask_;
+    for (int b = 0; b < PROBE_BUCKETS; b++)
+    {
+      auto& bucket = table_[(home + b) & mask_];
+      for (auto& e : bucket.entry)
+        if (e.state == EMPTY) return &e;
+    }
+    return nullptr;
+  }
+  entry_t* find(const key_t& key) noexcept
+  {
+    const uint32_t home = hash(key) & mask_;
+    for (int b = 0; b < PROBE_BUCKETS; b++)
+    {
+      auto& bucket = table_[(home + b) & mask_];
+      for (auto& e : bucket.entry)
+        if (e.state != EMPTY && e.key == key) return &e;
+    }
+    return nullptr;
+  }
+
+  std::unique_ptr<bucket_t[]> table_;
+  uint32_t mask_;
+  uint32_t max_buckets_;
+  uint16_t idle_;
+  uint16_t time_wait_;
+  stats_t  stats_;
+};
+
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+#ifndef GATHER_STREAM_HPP
+#define GATHER_STREAM_HPP
+
+#include <net/stream.hpp>
+#include <cstddef>
+
+/**
+ * Scatter-gather writes, for streams that can send several buffers as
+ * one message without joining them first, such as a WebSocket frame
+ * header and its payload. net::Stream has no such call, so a stream that
+ * can do it implements this next to net::Stream, and writers look for it
+ * with dynamic_cast.
+**/
+class Gather_stream
+{
+public:
+  /** Write @count buffers, in order, as if they were one */
+  virtual void writev(const net::Stream::buffer_t* bufs, size_t count) = 0;
+
+  virtual ~Gather_stream() = default;
+};
+
+#endif
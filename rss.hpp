@@ -0,0 +1,109 @@
+#pragma once
+#ifndef RSS_HPP
+#define RSS_HPP
+
+#include <net/tcp/connection.hpp>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Toeplitz hash as specified for Receive Side Scaling, so that software
+ * steering and a NIC programmed with the same key agree on placement.
+ *
+ * The hash is computed over a precalculated table of one 32-bit word per
+ * (input byte, byte value), which turns the bitwise Toeplitz loop into
+ * 12 lookups for a TCP/IPv4 tuple.
+**/
+class RSS_hasher
+{
+public:
+  static const int INPUT_LEN = 12; // saddr, daddr, sport, dport
+  static const int KEY_LEN   = 40;
+  static const int RETA_SIZE = 128;
+  using key_t = std::array<uint8_t, KEY_LEN>;
+
+  // the default key from the Microsoft RSS specification
+  static constexpr key_t default_key() {
+    return {{
+      0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+      0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+      0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+      0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+      0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+    }};
+  }
+
+  RSS_hasher() : RSS_hasher(default_key(), {0}) {}
+
+  RSS_hasher(const key_t& key, const std::vector<int>& cpus)
+  {
+    set_key(key);
+    set_cpus(cpus);
+  }
+
+  void set_key(const key_t& key)
+  {
+    for (int i = 0; i < INPUT_LEN; i++)
+    for (int v = 0; v < 256; v++)
+    {
+      uint32_t result = 0;
+      for (int bit = 0; bit < 8; bit++)
+      {
+        if ((v & (0x80 >> bit)) == 0) continue;
+        // the 32 key bits starting at input bit (i*8 + bit)
+        const int kbit = i * 8 + bit;
+        const int kb = kbit / 8, ks = kbit % 8;
+        uint64_t window = (uint64_t) key[kb] << 32 | (uint64_t) key[kb+1] << 24
+                        | (uint64_t) key[kb+2] << 16 | (uint64_t) key[kb+3] << 8
+                        | key[kb+4];
+        result ^= (uint32_t) (window >> (8 - ks));
+      }
+      table[i][v] = result;
+    }
+  }
+
+  /** Spread @cpus over the indirection table, like a NIC RETA */
+  void set_cpus(const std::vector<int>& cpus)
+  {
+    assert(not cpus.empty());
+    for (int i = 0; i < RETA_SIZE; i++)
+        reta[i] = cpus[i % cpus.size()];
+  }
+
+  uint32_t hash(const uint8_t input[INPUT_LEN]) const noexcept
+  {
+    uint32_t result = 0;
+    for (int i = 0; i < INPUT_LEN; i++)
+        result ^= table[i][input[i]];
+    return result;
+  }
+
+  /** Hash a (local, remote) tuple in the order the NIC sees it on ingress */
+  uint32_t hash(const net::tcp::Connection::Tuple& tuple) const noexcept
+  {
+    const uint32_t saddr = tuple.second.address().whole;
+    const uint32_t daddr = tuple.first.address().whole;
+    const uint16_t sport = tuple.second.port();
+    const uint16_t dport = tuple.first.port();
+    // addresses are kept in network order, ports in host order
+    const uint8_t input[INPUT_LEN] = {
+      (uint8_t) saddr, (uint8_t) (saddr >> 8), (uint8_t) (saddr >> 16), (uint8_t) (saddr >> 24),
+      (uint8_t) daddr, (uint8_t) (daddr >> 8), (uint8_t) (daddr >> 16), (uint8_t) (daddr >> 24),
+      (uint8_t) (sport >> 8), (uint8_t) sport,
+      (uint8_t) (dport >> 8), (uint8_t) dport
+    };
+    return hash(input);
+  }
+
+  int cpu_for(const net::tcp::Connection::Tuple& tuple) const noexcept {
+    return reta[hash(tuple) % RETA_SIZE];
+  }
+
+private:
+  uint32_t table[INPUT_LEN][256];
+  int reta[RETA_SIZE];
+};
+
+#endif
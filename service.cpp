@@ -1,17 +1,34 @@
 #include <os>
 #include <net/inet>
 #include <net/interfaces>
-#include <net/ws/connector.hpp>
 #include <memdisk>
 #include <https>
 #include <deque>
+#include "tcp_smp.hpp"
+#include "tls_smp_server.hpp"
+#include "ws_connector.hpp"
+#include "ws_broadcast.hpp"
 
 // configuration
 static const bool ENABLE_TLS    = true;
 static const bool USE_BOTAN_TLS = false;
 static const bool USE_S2N_TLS   = true;
+// TLS on worker CPUs, with the library chosen above: offloaded
+// from the BSP, or fully connection-affine with TCP_OVER_SMP
+static const bool USE_SMP_TLS   = false;
+// one HTTP/WebSocket server per CPU, all on the same port
 static const bool TCP_OVER_SMP  = false;
-//static_assert(SMP_MAX_CORES > 1 || TCP_OVER_SMP == false, "SMP must be enabled");
+// permessage-deflate for clients that offer it. Compressed messages
+// are copied through zlib, which rules out the zero-copy writev path
+static const bool WS_DEFLATE    = false;
+// push the test buffer to every client through one broadcast group,
+// instead of writing it to each socket
+static const bool WS_BROADCAST  = false;
+// hand messages over in chunks as they arrive, instead of whole
+static const bool WS_STREAMING  = false;
+// SMP TLS streams quiet for 30 seconds give back their buffers
+static const bool TLS_IDLE_RELEASE = true;
+static_assert(SMP_MAX_CORES > 1 || TCP_OVER_SMP == false, "SMP must be enabled");
 
 //#define DISABLE_CRASH_CONTEXT 1
 #include <crash>
@@ -20,9 +37,10 @@ struct alignas(SMP_ALIGN) HTTP_server
 {
   http::Server* server = nullptr;
   net::Stream::buffer_t buffer = nullptr;
-  net::WS_server_connector* ws_serve = nullptr;
+  WS_connector* ws_serve = nullptr;
 };
 static SMP::Array<HTTP_server> httpd;
+static WS_broadcast* ws_group = nullptr;
 
 bool accept_client(net::Socket remote, std::string origin)
 {
@@ -39,7 +57,49 @@ void websocket_service(net::TCP& tcp, uint16_t port)
 {
   if (ENABLE_TLS)
   {
-    if (USE_BOTAN_TLS)
+    if (USE_SMP_TLS)
+    {
+      auto& filesys = fs::memdisk().fs();
+      http::TLS_SMP_server* server;
+      if (USE_BOTAN_TLS)
+      {
+        // load CA certificate
+        auto ca_cert = filesys.stat("/test.der");
+        // load CA private key
+        auto ca_key  = filesys.stat("/test.key");
+        // load server private key
+        auto srv_key = filesys.stat("/server.key");
+
+        server = new http::TLS_SMP_server(
+              "blabla", ca_key, ca_cert, srv_key, tcp);
+        // ECDSA P-256 for clients that support it, RSA for the rest
+        auto ec_cert = filesys.stat("/ecdsa.pem");
+        auto ec_key  = filesys.stat("/ecdsa.key");
+        server->add_certificate(ec_cert, ec_key);
+      }
+      else
+      {
+        auto cert = filesys.read_file("/test.pem");
+        assert(cert.is_valid());
+        auto key  = filesys.read_file("/test.key");
+        assert(key.is_valid());
+
+        server = new http::TLS_SMP_server(tcp);
+        if (USE_S2N_TLS)
+            server->load_s2n(cert.to_string(), key.to_string());
+        else
+            server->load_openssl(cert.to_string(), key.to_string());
+      }
+      // one CPU for handshakes, the rest for established streams
+      if (not server->is_affine() && SMP::cpu_count() >= 4)
+      {
+        std::vector<int> data;
+        for (int cpu = 2; cpu < SMP::cpu_count(); cpu++) data.push_back(cpu);
+        server->set_cpu_split({1}, std::move(data));
+      }
+      PER_CPU(httpd).server = server;
+    }
+    else if (USE_BOTAN_TLS)
     {
       auto& filesys = fs::memdisk().fs();
       // load CA certificate
@@ -80,8 +140,8 @@ void websocket_service(net::TCP& tcp, uint16_t port)
   PER_CPU(httpd).buffer = net::Stream::construct_buffer(1200);
 
   // Set up server connector
-  PER_CPU(httpd).ws_serve = new net::WS_server_connector(
-    [&tcp] (net::WebSocket_ptr ws)
+  PER_CPU(httpd).ws_serve = new WS_connector(
+    [&tcp] (WS_stream_ptr ws)
     {
       assert(SMP::cpu_id() == tcp.get_cpuid());
       // sometimes we get failed WS connections
@@ -95,19 +155,49 @@ void websocket_service(net::TCP& tcp, uint16_t port)
       [] (auto message) {
         printf("WebSocket on_read: %.*s\n", (int) message->size(), message->data());
       };
+      if (WS_STREAMING) {
+        wptr->set_max_message(64 * 1024 * 1024);
+        wptr->on_chunk =
+        [] (const WS_chunk& chunk) {
+          if (chunk.last)
+            printf("WebSocket on_chunk: message ends with %zu bytes\n", chunk.len);
+        };
+      }
       wptr->on_close =
       [wptr] (uint16_t) {
+        if (WS_BROADCAST) ws_group->remove(*wptr);
         delete wptr;
       };
+      if (WS_BROADCAST) {
+        ws_group->add(*wptr);
+        return;
+      }
 
       //socket->write("THIS IS A TEST CAN YOU HEAR THIS?");
-      for (int i = 0; i < 1500; i++)
-          wptr->write(PER_CPU(httpd).buffer, net::op_code::BINARY);
-
-      wptr->close();
+      // send 1500 messages, pausing whenever the stream is full
+      auto remaining = std::make_shared<int>(1500);
+      auto send_more =
+      [wptr, remaining] (size_t) {
+        auto& stream = wptr->get_connection();
+        while (*remaining > 0 && stream.is_writable()) {
+          wptr->write(PER_CPU(httpd).buffer, ws::BINARY);
+          (*remaining)--;
+        }
+        if (*remaining == 0) {
+          *remaining = -1;
+          wptr->close();
+        }
+      };
+      wptr->get_connection().on_write(send_more);
+      send_more(0);
     },
     accept_client);
-  PER_CPU(httpd).server->on_request(*PER_CPU(httpd).ws_serve);
+  if (WS_DEFLATE) {
+    ws::deflate_options deflate;
+    deflate.enabled = true;
+    PER_CPU(httpd).ws_serve->set_deflate(deflate);
+  }
+  PER_CPU(httpd).server->on_request({PER_CPU(httpd).ws_serve, &WS_connector::handle});
   PER_CPU(httpd).server->listen(port);
   /// server ///
 }
@@ -152,13 +242,35 @@ void Service::start()
     assert(!err);
   });
 
+  if (WS_BROADCAST)
+  {
+    ws_group = new WS_broadcast;
+    // slow clients miss messages instead of queueing them
+    ws_group->set_drop_when_blocked(true);
+    using namespace std::chrono;
+    Timers::periodic(10ms, [] (int) {
+      const auto& buffer = PER_CPU(httpd).buffer;
+      if (buffer) ws_group->send(buffer->data(), buffer->size(), ws::BINARY);
+    });
+  }
+
+  // read by every CPU, so set once, here on the BSP, before they start
+  if (USE_SMP_TLS && TLS_IDLE_RELEASE) {
+    using namespace std::chrono;
+    tls_smp_set_idle(30s);
+  }
+
   if (TCP_OVER_SMP == false)
   {
     // run websocket server locally
     websocket_service(inet.tcp(), 8000);
   } else {
-    // run websocket servers on CPUs
-    //init_tcp_smp_system(inet, tcp_service);
+    // run websocket servers on every CPU, connections spread by
+    // their 4-tuple hash (like SO_REUSEPORT) and never moved again
+    tcp_smp_options options;
+    options.steering    = tcp_smp_options::RSS;
+    options.include_bsp = true;
+    init_tcp_smp_system(inet, tcp_service, options);
   }
 }
 
@@ -178,11 +290,18 @@ void Service::ready()
 
   printf("Size of TCP connection: 1x %zu 1000x %zu kB\n", sizeof(tcp::Connection), (1000*sizeof(tcp::Connection))/1024);
   printf("Size of TLS stream:     1x %u 1000x %u kB\n", 1024*100, 1000*100);
+  printf("Size of SMP TLS stream: 1x %zu + %zu (state), without buffers\n",
+         sizeof(tls::SMP_client), sizeof(tls::SMP_TLS_State));
+  printf("Size of WebSocket:      1x %zu, without buffers\n", sizeof(WS_stream));
   printf("Size of messages:       1x %u 1000x %u kB\n", 1200*1500, (1000*1500*1200)/1024);
+  printf("TLS send queue limit:   1x %u 1000x %u kB\n",
+         tls::SMP_client::DEFAULT_HIGH_WATERMARK,
+         1000 * (tls::SMP_client::DEFAULT_HIGH_WATERMARK / 1024));
 
   using namespace std::chrono;
   Timers::periodic(1s, [] (int) {
     //print_heap_info();
+    //ws::print_deflate_stats();
   });
 
   StackSampler::begin();
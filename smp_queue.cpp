@@ -0,0 +1,124 @@
+#include "smp_queue.hpp"
+#include <os>
+
+SMP_ARRAY<SMP_queue::queue_t> SMP_queue::queues;
+
+SMP_queue::queue_t::queue_t()
+{
+  for (size_t i = 0; i < RING_SIZE; i++)
+      cells[i].seq.store(i, std::memory_order_relaxed);
+}
+
+void SMP_queue::queue_t::push_overflow(SMP::task_func func)
+{
+  lock(overflow_lock);
+  overflow.push_back(std::move(func));
+  overflowed.store(true, std::memory_order_release);
+  unlock(overflow_lock);
+}
+
+bool SMP_queue::queue_t::run_one()
+{
+  cell_t& cell = cells[dequeue_pos & (RING_SIZE - 1)];
+  const size_t seq = cell.seq.load(std::memory_order_acquire);
+  // empty, or the producer has not finished constructing the task
+  if (seq != dequeue_pos + 1) return false;
+  cell.run(cell.storage);
+  cell.seq.store(dequeue_pos + RING_SIZE, std::memory_order_release);
+  dequeue_pos++;
+  return true;
+}
+
+bool SMP_queue::queue_t::empty() const noexcept
+{
+  const cell_t& cell = cells[dequeue_pos & (RING_SIZE - 1)];
+  return cell.seq.load(std::memory_order_acquire) != dequeue_pos + 1
+      && not overflowed.load(std::memory_order_acquire);
+}
+
+void SMP_queue::queue_t::drain()
+{
+  drains++;
+  while (true)
+  {
+    while (run_one());
+
+    if (overflowed.load(std::memory_order_acquire))
+    {
+      lock(overflow_lock);
+      std::vector<SMP::task_func> list;
+      list.swap(overflow);
+      overflowed.store(false, std::memory_order_release);
+      unlock(overflow_lock);
+
+      for (auto& func : list) func();
+      continue;
+    }
+
+    // still marked as scheduled, so producers don't signal while we poll
+    if (poll_cycles)
+    {
+      const uint64_t until = OS::cycles_since_boot() + poll_cycles;
+      while (empty() && OS::cycles_since_boot() < until)
+          asm volatile("pause");
+      if (not empty()) {
+        polled++;
+        continue;
+      }
+    }
+
+    // let producers signal again, then make sure nothing slipped in
+    // between the last check and clearing the flag
+    scheduled.store(false);
+    if (empty() || scheduled.exchange(true)) break;
+  }
+}
+
+void SMP_queue::drain()
+{
+  PER_CPU(queues).drain();
+}
+
+void SMP_queue::notify(int cpu)
+{
+  queues[cpu].signals.fetch_add(1, std::memory_order_relaxed);
+  // plain function pointer: the wake-up itself never allocates
+  if (cpu == 0) {
+    SMP::add_bsp_task(SMP::task_func{&SMP_queue::drain});
+  }
+  else {
+    SMP::add_task(SMP::task_func{&SMP_queue::drain}, cpu);
+    SMP::signal(cpu);
+  }
+}
+
+void SMP_queue::set_poll_cycles(int cpu, uint64_t cycles)
+{
+  add_task([cycles] () {
+    PER_CPU(queues).poll_cycles = cycles;
+  }, cpu);
+}
+
+SMP_queue::stats_t SMP_queue::get_stats(int cpu)
+{
+  const auto& q = queues.at(cpu);
+  stats_t st;
+  st.tasks   = q.tasks.load(std::memory_order_relaxed);
+  st.signals = q.signals.load(std::memory_order_relaxed);
+  st.drains  = q.drains;
+  st.polled  = q.polled;
+  return st;
+}
+
+void SMP_queue::print_stats()
+{
+  for (int cpu = 0; cpu < SMP::cpu_count(); cpu++)
+  {
+    const auto st = get_stats(cpu);
+    if (st.tasks == 0) continue;
+    printf("SMP queue CPU %d: %llu tasks %llu IPIs (%.1f tasks/IPI) %llu drains %llu polled\n",
+           cpu, (unsigned long long) st.tasks, (unsigned long long) st.signals,
+           st.signals ? (double) st.tasks / st.signals : 0.0,
+           (unsigned long long) st.drains, (unsigned long long) st.polled);
+  }
+}
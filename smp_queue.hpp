@@ -0,0 +1,162 @@
+#pragma once
+#ifndef SMP_QUEUE_HPP
+#define SMP_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <smp>
+
+/**
+ * Per-CPU task queues that never allocate.
+ *
+ * Each CPU owns a bounded multi-producer/single-consumer ring. A task is
+ * constructed directly inside a ring cell, so any callable with captures
+ * of up to SMP_queue::TASK_SIZE bytes is handed over without a heap
+ * allocation. Larger tasks and tasks that meet a full ring go to a
+ * locked overflow list instead. The consumer always drains the ring
+ * before the overflow, and producers keep using the overflow until it
+ * has been drained, so tasks from one producer run in the order they
+ * were added.
+ *
+ * A CPU is only signalled when it has no drain pending. While a CPU is
+ * draining its queue, and for an optional polling window afterwards,
+ * producers see the drain as pending and send no IPI at all.
+**/
+class SMP_queue
+{
+public:
+  static const size_t TASK_SIZE = 64;
+  static const size_t RING_SIZE = 512;
+
+  /** Run @func on @cpu */
+  template <typename Func>
+  static void add_task(Func&& func, int cpu)
+  {
+    auto& q = queues[cpu];
+    q.tasks.fetch_add(1, std::memory_order_relaxed);
+    q.push(std::forward<Func>(func));
+    // only the first task after a drain needs to wake the CPU
+    if (not q.scheduled.exchange(true)) notify(cpu);
+  }
+
+  /** Run @func on the BSP */
+  template <typename Func>
+  static void add_bsp_task(Func&& func)
+  {
+    add_task(std::forward<Func>(func), 0);
+  }
+
+  /** Run everything queued for the current CPU */
+  static void drain();
+
+  /**
+   * Keep polling for new tasks for up to @cycles after the queue
+   * runs dry, so that a busy CPU gets its work without IPIs. 0 disables.
+   */
+  static void set_poll_cycles(int cpu, uint64_t cycles);
+
+  struct stats_t
+  {
+    uint64_t tasks   = 0; // added (from any CPU)
+    uint64_t signals = 0; // wake-ups sent, ie. IPIs
+    uint64_t drains  = 0;
+    uint64_t polled  = 0; // tasks picked up while polling
+  };
+  static stats_t get_stats(int cpu);
+  static void print_stats();
+
+private:
+  struct cell_t
+  {
+    std::atomic<size_t> seq;
+    void (*run)(void*);
+    alignas(16) char storage[TASK_SIZE];
+  };
+
+  template <typename Func>
+  static void run_task(void* ptr)
+  {
+    auto* func = static_cast<Func*>(ptr);
+    (*func)();
+    func->~Func();
+  }
+
+  struct alignas(SMP_ALIGN) queue_t
+  {
+    queue_t();
+
+    template <typename Func>
+    void push(Func&& func)
+    {
+      using F = typename std::decay<Func>::type;
+      if (alignof(F) <= 16
+          && not overflowed.load(std::memory_order_acquire)
+          && try_push(std::forward<Func>(func)))
+          return;
+      push_overflow(SMP::task_func::make_packed(std::forward<Func>(func)));
+    }
+
+    template <typename Func>
+    typename std::enable_if<(sizeof(typename std::decay<Func>::type) <= TASK_SIZE), bool>::type
+    try_push(Func&& func)
+    {
+      using F = typename std::decay<Func>::type;
+      size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+      cell_t* cell;
+      while (true)
+      {
+        cell = &cells[pos & (RING_SIZE - 1)];
+        const size_t seq = cell->seq.load(std::memory_order_acquire);
+        const intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+          if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+              break;
+        }
+        else if (diff < 0) {
+          return false; // full
+        }
+        else {
+          pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+      }
+      new (cell->storage) F(std::forward<Func>(func));
+      cell->run = &run_task<F>;
+      cell->seq.store(pos + 1, std::memory_order_release);
+      return true;
+    }
+
+    template <typename Func>
+    typename std::enable_if<(sizeof(typename std::decay<Func>::type) > TASK_SIZE), bool>::type
+    try_push(Func&&) {
+      return false;
+    }
+
+    void push_overflow(SMP::task_func);
+    bool run_one();
+    bool empty() const noexcept;
+    void drain();
+
+    alignas(SMP_ALIGN) std::atomic<size_t> enqueue_pos {0};
+    std::atomic<bool>     scheduled {false};
+    std::atomic<uint64_t> tasks {0};
+    std::atomic<uint64_t> signals {0};
+    // consumer side
+    alignas(SMP_ALIGN) size_t dequeue_pos = 0;
+    uint64_t poll_cycles = 0;
+    uint64_t drains = 0;
+    uint64_t polled = 0;
+    alignas(SMP_ALIGN) std::atomic<bool> overflowed {false};
+    spinlock_t overflow_lock = 0;
+    std::vector<SMP::task_func> overflow;
+    cell_t cells[RING_SIZE];
+  };
+
+  static void notify(int cpu);
+
+  static SMP_ARRAY<queue_t> queues;
+};
+
+#endif
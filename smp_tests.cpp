@@ -1,10 +1,18 @@
 #define DEBUG_SMP 1
+#include <os>
 #include <smp>
 #include <cstdio>
 
+#include <net/stream.hpp>
+#include "buffer_pool.hpp"
+
 struct alignas(SMP_ALIGN) taskdata_t
 {
   int count = 0;
+  // allocating_benchmark
+  std::vector<net::Stream::buffer_t> buffers;
+  uint64_t alloc_cycles = 0;
+  uint64_t free_cycles  = 0;
 };
 static SMP_ARRAY<taskdata_t> taskdata;
 
@@ -71,6 +79,54 @@ void allocating_task()
     });
 }
 
+/**
+ * Like allocating_task, but with many short-lived stream buffers
+ * allocated on a worker and freed on the BSP, as the TLS SMP path does.
+ * Measures cycles per allocation and per (remote) free, either from the
+ * heap or from the per-CPU buffer pool.
+**/
+void allocating_benchmark(bool pooled)
+{
+  static const int ROUNDS = 1000;
+  static const int BATCH  = 256;
+  static const int BUFLEN = 1200;
+  static const char data[BUFLEN] = {0};
+  auto& td = PER_CPU(taskdata);
+
+  auto t0 = OS::cycles_since_boot();
+  for (int i = 0; i < BATCH; i++)
+  {
+    if (pooled)
+      td.buffers.push_back(buffer_pool::copy(data, BUFLEN));
+    else
+      td.buffers.push_back(net::Stream::construct_buffer(data, data + BUFLEN));
+  }
+  td.alloc_cycles += OS::cycles_since_boot() - t0;
+
+  SMP::add_bsp_task(
+    [x = SMP::cpu_id(), pooled] ()
+    {
+      // release everything on the main CPU
+      auto t0 = OS::cycles_since_boot();
+      taskdata[x].buffers.clear();
+      taskdata[x].free_cycles += OS::cycles_since_boot() - t0;
+
+      SMP::add_task(
+        [x, pooled] () {
+          auto& td = PER_CPU(taskdata);
+          if (++td.count < ROUNDS) {
+            allocating_benchmark(pooled);
+            return;
+          }
+          SMP_PRINT("%d: %s: %llu cycles/alloc, %llu cycles/remote free\n",
+                SMP::cpu_id(), pooled ? "buffer pool" : "heap",
+                (unsigned long long) td.alloc_cycles / (ROUNDS * BATCH),
+                (unsigned long long) td.free_cycles / (ROUNDS * BATCH));
+        }, x);
+      SMP::signal(x);
+    });
+}
+
 static spinlock_t testlock = 0;
 void per_cpu_task()
 {
@@ -144,3 +200,642 @@ void tls_task()
   assert(tbss_value == 100);
   unlock(testlock);
 }
+
+#include <map>
+#include "flow_table.hpp"
+static net::tcp::Connection::Tuple make_flow(uint32_t n)
+{
+  // 10.x.y.z:port -> 10.0.0.42:8000
+  const net::Socket local {{10,0,0,42}, 8000};
+  const net::Socket remote {{10, (uint8_t) (n >> 16), (uint8_t) (n >> 8), (uint8_t) n},
+                            (uint16_t) (1024 + (n * 7919) % 60000)};
+  return {local, remote};
+}
+
+void flow_table_benchmark()
+{
+  static const int LOOKUPS = 1000000;
+  for (const uint32_t flows : {1000u, 10000u, 100000u})
+  {
+    std::vector<net::tcp::Connection::Tuple> tuples;
+    for (uint32_t i = 0; i < flows; i++) tuples.push_back(make_flow(i));
+
+    std::map<net::tcp::Connection::Tuple, int> routes;
+    // one bucket per flow keeps the load factor at 25%
+    Flow_table table(flows, 4 * flows, 3600, 60);
+    for (uint32_t i = 0; i < flows; i++) {
+      routes[tuples[i]] = i % 16;
+      table.insert(tuples[i], i % 16, 0);
+    }
+
+    int sum = 0;
+    auto t0 = OS::cycles_since_boot();
+    for (int i = 0; i < LOOKUPS; i++)
+      sum += routes.find(tuples[(i * 2654435761u) % flows])->second;
+    auto t1 = OS::cycles_since_boot();
+    for (int i = 0; i < LOOKUPS; i++)
+      sum -= table.lookup(tuples[(i * 2654435761u) % flows], 0);
+    auto t2 = OS::cycles_since_boot();
+    assert(sum == 0);
+
+    printf("%6u flows: std::map %4llu cycles/lookup, Flow_table %4llu cycles/lookup"
+           " (%zu kB, grown %llu times)\n", flows,
+           (unsigned long long) (t1 - t0) / LOOKUPS,
+           (unsigned long long) (t2 - t1) / LOOKUPS,
+           table.memory_usage() / 1024,
+           (unsigned long long) table.stats().grows);
+  }
+}
+
+#include "rss.hpp"
+void rss_distribution_test()
+{
+  // known answer from the Microsoft RSS verification suite
+  static const uint8_t input[] = {66,9,149,187, 161,142,100,80, 0x0a,0xea, 0x06,0xe6};
+  RSS_hasher rss(RSS_hasher::default_key(), {1, 2, 3, 4, 5, 6, 7});
+  assert(rss.hash(input) == 0x51ccc178);
+
+  static const int FLOWS = 70000;
+  int count[8] = {0};
+  for (int i = 0; i < FLOWS; i++)
+      count[rss.cpu_for(make_flow(i))]++;
+
+  assert(count[0] == 0);
+  for (int cpu = 1; cpu <= 7; cpu++)
+  {
+    SMP_PRINT("RSS: CPU %d got %d of %d flows\n", cpu, count[cpu], FLOWS);
+    // allow 5% deviation from a perfect spread
+    assert(std::abs(count[cpu] - FLOWS / 7) < FLOWS / 7 / 20);
+  }
+}
+
+#include <botan/tls_client.h>
+#include <botan/tls_server.h>
+#include <botan/certstor.h>
+#include "tls_smp_system.hpp"
+#include "tls_smp_policy.hpp"
+/**
+ * Full handshakes per second on one core, client and server in memory.
+ * The client only offers one signature type, which selects the profile.
+**/
+struct handshake_pipe : public Botan::TLS::Callbacks
+{
+  std::vector<uint8_t>* out;
+  bool active = false;
+  void tls_emit_data(const uint8_t buf[], size_t len) override {
+    out->insert(out->end(), buf, buf + len);
+  }
+  void tls_record_received(uint64_t, const uint8_t[], size_t) override {}
+  void tls_alert(Botan::TLS::Alert) override {}
+  bool tls_session_established(const Botan::TLS::Session&) override {
+    return false;
+  }
+  void tls_session_activated() override { active = true; }
+};
+
+struct handshake_client_creds : public Botan::Credentials_Manager
+{
+  Botan::Certificate_Store_In_Memory store;
+  std::vector<Botan::Certificate_Store*>
+  trusted_certificate_authorities(const std::string&, const std::string&) override {
+    return { &store };
+  }
+};
+
+struct handshake_client_policy : public TLS_SMP_policy
+{
+  std::string sig;
+  std::vector<std::string> allowed_signature_methods() const override {
+    return { sig };
+  }
+};
+
+void tls_handshake_benchmark(tls_smp_system& sys,
+                             const std::vector<Botan::X509_Certificate>& roots)
+{
+  handshake_client_creds client_creds;
+  for (auto& cert : roots) client_creds.store.add_certificate(cert);
+  Botan::TLS::Session_Manager_Noop no_sessions;
+  TLS_SMP_policy server_policy;
+  auto& rng = tls_smp_system::get_rng();
+
+  for (const std::string sig : {"ECDSA", "RSA"})
+  {
+    handshake_client_policy client_policy;
+    client_policy.sig = sig;
+    const int ROUNDS = (sig == "RSA") ? 20 : 200;
+
+    const auto t0 = OS::cycles_since_boot();
+    for (int i = 0; i < ROUNDS; i++)
+    {
+      std::vector<uint8_t> to_server, to_client;
+      handshake_pipe cpipe, spipe;
+      cpipe.out = &to_server;
+      spipe.out = &to_client;
+      Botan::TLS::Server server(spipe, no_sessions, *sys.credman, server_policy, rng);
+      Botan::TLS::Client client(cpipe, no_sessions, client_creds, client_policy, rng);
+
+      while (not (cpipe.active && spipe.active))
+      {
+        assert(not to_server.empty() || not to_client.empty());
+        std::vector<uint8_t> buf;
+        buf.swap(to_server);
+        if (not buf.empty()) server.received_data(buf.data(), buf.size());
+        buf.clear();
+        buf.swap(to_client);
+        if (not buf.empty()) client.received_data(buf.data(), buf.size());
+      }
+    }
+    const auto cycles = (OS::cycles_since_boot() - t0) / ROUNDS;
+    SMP_PRINT("%s: %llu cycles/handshake, %.1f handshakes/sec/core (incl. client)\n",
+              sig.c_str(), (unsigned long long) cycles,
+              OS::cpu_freq().count() * 1e6 / cycles);
+  }
+}
+
+#include <openssl/ssl.h>
+#include "tls_smp_engine.hpp"
+/**
+ * Bulk throughput of the engine loaded into @sys, on the calling CPU.
+ * The peer is an OpenSSL client in memory, so every backend is measured
+ * against the same client. Run it on every worker at once to see how
+ * the backend scales across cores.
+**/
+struct engine_sink : public TLS_SMP_engine::Output
+{
+  std::vector<uint8_t> out;
+  bool   keep   = true;
+  bool   active = false;
+  bool   resumed = false;
+  size_t emitted  = 0;
+  size_t received = 0;
+  void tls_emit(const uint8_t* data, size_t len) override {
+    emitted += len;
+    if (keep) out.insert(out.end(), data, data + len);
+  }
+  void tls_record(const uint8_t*, size_t len) override { received += len; }
+  void tls_activated(bool r) override { active = true; resumed = r; }
+  void tls_closed() override {}
+};
+
+// an OpenSSL client in memory, handshaking with @engine
+static SSL* engine_handshake(SSL_CTX* cctx, SSL_SESSION* session,
+                             TLS_SMP_engine& engine, engine_sink& sink)
+{
+  SSL* client = SSL_new(cctx);
+  SSL_set_bio(client, BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+  SSL_set_connect_state(client);
+  if (session) SSL_set_session(client, session);
+
+  std::vector<uint8_t> buf(16384);
+  while (not (sink.active && SSL_is_init_finished(client)))
+  {
+    SSL_do_handshake(client);
+    int n;
+    while ((n = BIO_read(SSL_get_wbio(client), buf.data(), buf.size())) > 0)
+        engine.received(buf.data(), n);
+    if (not sink.out.empty()) {
+      BIO_write(SSL_get_rbio(client), sink.out.data(), sink.out.size());
+      sink.out.clear();
+    }
+  }
+  return client;
+}
+
+void tls_engine_benchmark(tls_smp_system& sys)
+{
+  static const size_t CHUNK = 16384;
+  static const size_t TOTAL = 16 * 1024 * 1024;
+  static uint8_t plain[CHUNK];
+
+  engine_sink sink;
+  auto engine = sys.make_engine(sink);
+
+  SSL_CTX* cctx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_verify(cctx, SSL_VERIFY_NONE, nullptr);
+  SSL* client = engine_handshake(cctx, nullptr, *engine, sink);
+  BIO* cwr = SSL_get_wbio(client);
+  std::vector<uint8_t> buf(CHUNK + 1024);
+
+  // encrypt: server to client, ciphertext counted and dropped
+  sink.keep = false;
+  auto t0 = OS::cycles_since_boot();
+  for (size_t i = 0; i < TOTAL; i += CHUNK)
+      engine->send(plain, CHUNK);
+  const auto enc_cycles = OS::cycles_since_boot() - t0;
+  assert(sink.emitted >= TOTAL);
+
+  // decrypt: records from the client, encrypted up front
+  std::vector<std::vector<uint8_t>> records;
+  for (size_t i = 0; i < TOTAL; i += CHUNK)
+  {
+    SSL_write(client, plain, CHUNK);
+    records.emplace_back();
+    int n;
+    while ((n = BIO_read(cwr, buf.data(), buf.size())) > 0)
+        records.back().insert(records.back().end(), buf.data(), buf.data() + n);
+  }
+  t0 = OS::cycles_since_boot();
+  for (auto& rec : records)
+      engine->received(rec.data(), rec.size());
+  const auto dec_cycles = OS::cycles_since_boot() - t0;
+  assert(sink.received == TOTAL);
+
+  SSL_free(client);
+  SSL_CTX_free(cctx);
+
+  const double hz = OS::cpu_freq().count() * 1e6;
+  SMP_PRINT("CPU %d %s: encrypt %.1f MB/s, decrypt %.1f MB/s (16 KB records)\n",
+            SMP::cpu_id(), engine->name(),
+            TOTAL / (enc_cycles / hz) / 1e6, TOTAL / (dec_cycles / hz) / 1e6);
+}
+
+/**
+ * The engine loaded into @sys must report a resumed session as resumed,
+ * or the resumption rate in tls_smp_print_stats() is wrong. A full
+ * handshake, then one offering its session, which the client says
+ * whether it resumed.
+**/
+void tls_resumption_check(tls_smp_system& sys)
+{
+  SSL_CTX* cctx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_verify(cctx, SSL_VERIFY_NONE, nullptr);
+  // sessions of TLS 1.2 are known once the handshake is done
+  SSL_CTX_set_max_proto_version(cctx, TLS1_2_VERSION);
+
+  engine_sink first;
+  auto engine = sys.make_engine(first);
+  SSL* client = engine_handshake(cctx, nullptr, *engine, first);
+  assert(not first.resumed);
+  SSL_SESSION* session = SSL_get1_session(client);
+  // without a shutdown, OpenSSL takes the session as broken
+  SSL_set_shutdown(client, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+  SSL_free(client);
+
+  engine_sink second;
+  auto engine2 = sys.make_engine(second);
+  client = engine_handshake(cctx, session, *engine2, second);
+  const bool reused = SSL_session_reused(client);
+  assert(second.resumed == reused);
+  SSL_free(client);
+  SSL_SESSION_free(session);
+  SSL_CTX_free(cctx);
+
+  SMP_PRINT("CPU %d %s: full handshake, then %s\n", SMP::cpu_id(),
+            engine->name(), reused ? "resumed" : "full again (no resumption)");
+}
+
+#include "ws_mask.hpp"
+/**
+ * WebSocket unmasking, byte loop against the SIMD kernels, on payloads
+ * that start one byte past an aligned address like a frame after a
+ * 6-byte client header would.
+**/
+void ws_mask_benchmark()
+{
+  static const uint8_t key[4] = {0x37, 0xfa, 0x21, 0x3d};
+  static const size_t BYTES = 64 * 1024 * 1024;
+  std::vector<uint8_t> buffer(65536 + 64);
+  uint8_t* data = buffer.data() + 1;
+
+  using kernel_t = void(*)(uint8_t*, size_t, const uint8_t*, size_t);
+  struct { const char* name; kernel_t func; } kernels[] = {
+    {"scalar", &ws_mask_scalar},
+    {"SSE2",   &ws_mask_sse2},
+    {"AVX2",   &ws_mask_avx2}
+  };
+  const int count = ws_mask_has_avx2() ? 3 : 2;
+
+  for (size_t len = 64; len <= 65536; len *= 4)
+  {
+    // every kernel must agree with the byte loop
+    std::vector<uint8_t> expected(data, data + len);
+    ws_mask_scalar(expected.data(), len, key, 1);
+    for (int k = 1; k < count; k++) {
+      std::vector<uint8_t> copy(data, data + len);
+      kernels[k].func(copy.data(), len, key, 1);
+      assert(copy == expected);
+    }
+
+    printf("%6zu bytes:", len);
+    for (int k = 0; k < count; k++)
+    {
+      const size_t rounds = BYTES / len;
+      const auto t0 = OS::cycles_since_boot();
+      for (size_t r = 0; r < rounds; r++)
+          kernels[k].func(data, len, key, 0);
+      const auto cycles = OS::cycles_since_boot() - t0;
+      printf("  %s %.3f cycles/byte", kernels[k].name, (double) cycles / (rounds * len));
+    }
+    printf("\n");
+  }
+  printf("ws_mask() uses %s\n", ws_mask_kernel());
+}
+
+#include "ws_utf8.hpp"
+#include <string>
+
+void ws_utf8_benchmark()
+{
+  static const size_t BYTES = 64 * 1024 * 1024;
+  // chat-sized and bulk payloads of each kind
+  static const char* samples[] = {
+    "{\"user\":\"alice\",\"text\":\"hello there\",\"ts\":1700000000}",
+    "Grüße aus Köln, señor — ça va? {\"π\":3.14159}",
+    "你好，世界。今日は良い天気ですね。안녕하세요"
+  };
+  static const char* names[] = { "ASCII", "mixed", "CJK" };
+
+  using kernel_t = bool(*)(const uint8_t*, size_t);
+  struct { const char* name; kernel_t func; } kernels[] = {
+    {"scalar", &utf8_valid_scalar},
+    {"SSE4",   &utf8_valid_sse},
+    {"AVX2",   &utf8_valid_avx2}
+  };
+  const int count = ws_mask_has_avx2() ? 3 : 2;
+
+  for (int s = 0; s < 3; s++)
+  for (size_t len = 64; len <= 65536; len *= 32)
+  {
+    std::string text;
+    while (text.size() < len) text += samples[s];
+    // cut at a character boundary
+    size_t end = len;
+    while ((text[end] & 0xC0) == 0x80) end--;
+    text.resize(end);
+    const auto* data = (const uint8_t*) text.data();
+
+    for (int k = 0; k < count; k++) {
+      assert(kernels[k].func(data, text.size()));
+      // a stray continuation byte at the end must be caught
+      std::string bad = text + "\x80";
+      assert(not kernels[k].func((const uint8_t*) bad.data(), bad.size()));
+    }
+
+    printf("%5s %6zu bytes:", names[s], text.size());
+    for (int k = 0; k < count; k++)
+    {
+      const size_t rounds = BYTES / text.size();
+      bool valid = true;
+      const auto t0 = OS::cycles_since_boot();
+      for (size_t r = 0; r < rounds; r++)
+          valid &= kernels[k].func(data, text.size());
+      const auto cycles = OS::cycles_since_boot() - t0;
+      assert(valid);
+      printf("  %s %.3f cycles/byte", kernels[k].name, (double) cycles / (rounds * text.size()));
+    }
+    printf("\n");
+  }
+  printf("utf8_valid() uses %s\n", utf8_kernel());
+}
+
+#include "ws_deflate.hpp"
+
+void ws_deflate_benchmark()
+{
+  // messages like the artillery scenario in test.yml, and the service's
+  static const char* pets[][2] = {
+    {"dog", "Leo"}, {"dog", "Figo"}, {"dog", "Mali"}, {"cat", "Chewbacca"}, {"cat", "Puss"}
+  };
+  std::vector<std::string> messages;
+  for (int i = 0; i < 1000; i++) {
+    const auto* pet = pets[i % 5];
+    messages.push_back("{\"url\":\"/pets\",\"json\":{\"name\":\"" + std::string(pet[1]) +
+                       "\",\"species\":\"" + pet[0] + "\",\"id\":" + std::to_string(i) + "}}");
+  }
+  std::string batch = "[";
+  for (int i = 0; i < 24; i++) batch += messages[i] + ",";
+  batch.back() = ']';
+  batch.resize(1200);
+
+  struct { const char* name; int bits; bool takeover; int level; } configs[] = {
+    {"no takeover, 15 bits, level 6", 15, false, 6},
+    {"no takeover, 15 bits, level 1", 15, false, 1},
+    {"takeover,    15 bits, level 6", 15, true,  6},
+    {"takeover,    10 bits, level 6", 10, true,  6},
+  };
+  for (const auto& cfg : configs)
+  for (int kind = 0; kind < 2; kind++)
+  {
+    ws::deflater def(cfg.bits, cfg.takeover, cfg.level);
+    ws::inflater inf(cfg.bits, cfg.takeover);
+    uint64_t raw = 0, deflated = 0, def_cycles = 0, inf_cycles = 0;
+    for (int round = 0; round < 10; round++)
+    for (size_t i = 0; i < messages.size(); i++)
+    {
+      const auto& msg = (kind == 0) ? messages[i] : batch;
+      size_t len;
+      auto t0 = OS::cycles_since_boot();
+      const uint8_t* out = def.compress((const uint8_t*) msg.data(), msg.size(), len);
+      def_cycles += OS::cycles_since_boot() - t0;
+      // the scratch buffer is reused by the next compress()
+      std::vector<uint8_t> frame(out, out + len);
+
+      net::Stream::buffer_t plain;
+      t0 = OS::cycles_since_boot();
+      const uint16_t error = inf.decompress(frame.data(), frame.size(), 1 << 20, plain);
+      inf_cycles += OS::cycles_since_boot() - t0;
+      assert(error == 0 && plain->size() == msg.size());
+      raw += msg.size();
+      deflated += len;
+    }
+    printf("%s, %s: %5.1f%% of raw, deflate %.1f inflate %.1f cycles/byte\n",
+           cfg.name, (kind == 0) ? "  70 byte" : "1200 byte",
+           100.0 * deflated / raw, (double) def_cycles / raw, (double) inf_cycles / raw);
+  }
+  ws::print_deflate_stats();
+}
+
+#include "ws_broadcast.hpp"
+#include <atomic>
+
+// a stream that only counts what is written to it
+struct alignas(SMP_ALIGN) sink_counter { std::atomic<uint64_t> writes {0}; };
+static SMP_ARRAY<sink_counter> sink_writes;
+
+struct sink_stream : public net::Stream
+{
+  void on_connect(ConnectCallback) override {}
+  void on_read(size_t, ReadCallback) override {}
+  void on_close(CloseCallback) override {}
+  void on_write(WriteCallback) override {}
+  void write(buffer_t) override { count(); }
+  void write(const void*, size_t) override { count(); }
+  void write(const std::string&) override { count(); }
+  void close() override {}
+  void abort() override {}
+  void reset_callbacks() override {}
+  net::Socket local() const override { return {}; }
+  net::Socket remote() const override { return {}; }
+  std::string to_string() const override { return "sink"; }
+  bool is_connected() const noexcept override { return true; }
+  bool is_writable() const noexcept override { return true; }
+  bool is_readable() const noexcept override { return true; }
+  bool is_closing() const noexcept override { return false; }
+  bool is_closed() const noexcept override { return false; }
+  int  get_cpuid() const noexcept override { return SMP::cpu_id(); }
+  net::Stream* transport() noexcept override { return nullptr; }
+  size_t serialize_to(void*) const override { return 0; }
+
+  static void count() {
+    PER_CPU(sink_writes).writes.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+static uint64_t total_sink_writes()
+{
+  uint64_t total = 0;
+  for (int cpu = 0; cpu < SMP::cpu_count(); cpu++)
+      total += sink_writes[cpu].writes.load(std::memory_order_relaxed);
+  return total;
+}
+
+void ws_broadcast_benchmark()
+{
+  static const int SUBSCRIBERS = 10000;
+  static const int MESSAGES = 100;
+  static std::vector<uint8_t> payload(1200, 'x');
+
+  // everyone on this CPU: one write() per socket versus one send()
+  std::vector<std::unique_ptr<WS_stream>> streams;
+  WS_broadcast local;
+  for (int i = 0; i < SUBSCRIBERS; i++) {
+    streams.push_back(std::make_unique<WS_stream>(std::make_unique<sink_stream>()));
+    local.add(*streams.back());
+  }
+  auto t0 = OS::cycles_since_boot();
+  for (int m = 0; m < MESSAGES; m++)
+  for (auto& ws : streams)
+      ws->write(payload.data(), payload.size(), ws::BINARY);
+  const auto per_socket = OS::cycles_since_boot() - t0;
+
+  t0 = OS::cycles_since_boot();
+  for (int m = 0; m < MESSAGES; m++)
+      local.send(payload.data(), payload.size());
+  const auto broadcast = OS::cycles_since_boot() - t0;
+
+  const double frames = (double) SUBSCRIBERS * MESSAGES;
+  printf("%d subscribers, 1 CPU: write() %.0f cycles/frame, send() %.0f cycles/frame\n",
+         SUBSCRIBERS, per_socket / frames, broadcast / frames);
+  for (auto& ws : streams) local.remove(*ws);
+  streams.clear();
+
+  // the same subscribers spread over every CPU, each adding its own
+  const int cpus = SMP::cpu_count();
+  auto* group = new WS_broadcast;
+  std::atomic<int> ready {0};
+  for (int cpu = 0; cpu < cpus; cpu++)
+  {
+    auto add = [group, &ready, cpus] () {
+      for (int i = 0; i < SUBSCRIBERS / cpus; i++) {
+        // leaked on purpose, the group is never torn down
+        auto* ws = new WS_stream(std::make_unique<sink_stream>());
+        group->add(*ws);
+      }
+      ready++;
+    };
+    if (cpu == SMP::cpu_id()) add();
+    else SMP_queue::add_task(add, cpu);
+  }
+  while (ready.load() < cpus) asm("pause");
+
+  const uint64_t before = total_sink_writes();
+  const uint64_t expected = before + (uint64_t) group->size() * MESSAGES;
+  t0 = OS::cycles_since_boot();
+  for (int m = 0; m < MESSAGES; m++)
+      group->send(payload.data(), payload.size());
+  while (total_sink_writes() < expected) asm("pause");
+  const auto sharded = OS::cycles_since_boot() - t0;
+  printf("%zu subscribers, %d CPUs: send() %.0f cycles/frame\n",
+         group->size(), cpus, sharded / frames);
+  group->print_stats();
+}
+
+#include "tls_smp_client.hpp"
+#include "ws_stream.hpp"
+/**
+ * Heap per idle connection for the engine loaded into @sys: engines
+ * after a handshake and one 4 KB message each way, then again after
+ * release_buffers(). The peers are OpenSSL clients in memory, freed
+ * before measuring. Object sizes are printed alongside, since they are
+ * paid on top for every connection.
+**/
+struct idle_peer
+{
+  engine_sink sink;
+  std::unique_ptr<TLS_SMP_engine> engine;
+  SSL* client = nullptr;
+  BIO* crd = nullptr;
+  BIO* cwr = nullptr;
+};
+
+static void idle_peer_pump(idle_peer& peer, std::vector<uint8_t>& buf)
+{
+  int n;
+  while ((n = BIO_read(peer.cwr, buf.data(), buf.size())) > 0)
+      peer.engine->received(buf.data(), n);
+  if (not peer.sink.out.empty()) {
+    BIO_write(peer.crd, peer.sink.out.data(), peer.sink.out.size());
+    peer.sink.out.clear();
+  }
+}
+
+void idle_memory_benchmark(tls_smp_system& sys)
+{
+  static const int CONNECTIONS = 1000;
+  static uint8_t message[4096];
+
+  SSL_CTX* cctx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_verify(cctx, SSL_VERIFY_NONE, nullptr);
+  std::vector<uint8_t> buf(16384 + 1024);
+  std::vector<std::unique_ptr<idle_peer>> peers;
+  peers.reserve(CONNECTIONS);
+
+  const size_t heap0 = OS::heap_usage();
+  for (int i = 0; i < CONNECTIONS; i++)
+  {
+    peers.push_back(std::make_unique<idle_peer>());
+    auto& peer = *peers.back();
+    peer.engine = sys.make_engine(peer.sink);
+    peer.client = SSL_new(cctx);
+    peer.crd = BIO_new(BIO_s_mem());
+    peer.cwr = BIO_new(BIO_s_mem());
+    SSL_set_bio(peer.client, peer.crd, peer.cwr);
+    SSL_set_connect_state(peer.client);
+    while (not (peer.sink.active && SSL_is_init_finished(peer.client)))
+    {
+      SSL_do_handshake(peer.client);
+      idle_peer_pump(peer, buf);
+    }
+    // one message each way, so every buffer has been used
+    peer.engine->send(message, sizeof(message));
+    idle_peer_pump(peer, buf);
+    while (SSL_read(peer.client, buf.data(), buf.size()) > 0);
+    SSL_write(peer.client, message, sizeof(message));
+    idle_peer_pump(peer, buf);
+    assert(peer.sink.received == sizeof(message));
+  }
+  for (auto& peer : peers) {
+    SSL_free(peer->client);
+    peer->client = nullptr;
+    std::vector<uint8_t>().swap(peer->sink.out);
+  }
+  const size_t busy = OS::heap_usage() - heap0;
+
+  const auto t0 = OS::cycles_since_boot();
+  for (auto& peer : peers) peer->engine->release_buffers();
+  const auto cycles = (OS::cycles_since_boot() - t0) / CONNECTIONS;
+  const size_t idle = OS::heap_usage() - heap0;
+
+  SMP_PRINT("%s, %d connections: %zu bytes/connection, %zu when idle"
+            " (%llu cycles to release)\n",
+            peers[0]->engine->name(), CONNECTIONS,
+            busy / CONNECTIONS, idle / CONNECTIONS, (unsigned long long) cycles);
+  SMP_PRINT("objects: SMP_client %zu, SMP_TLS_State %zu, WS_stream %zu,"
+            " tcp::Connection %zu bytes | TCP receive buffer %zu, %zu when idle\n",
+            sizeof(net::tls::SMP_client), sizeof(net::tls::SMP_TLS_State),
+            sizeof(WS_stream), sizeof(net::tcp::Connection),
+            WS_stream::READ_SIZE, tls_smp_get_idle().read_size);
+  peers.clear();
+  SSL_CTX_free(cctx);
+}
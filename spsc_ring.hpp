@@ -0,0 +1,55 @@
+#pragma once
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <smp>
+
+/**
+ * Bounded single-producer/single-consumer ring.
+ * Head and tail live on separate cache lines so the producer and the
+ * consumer CPU only share the slots they hand over.
+**/
+template <typename T, size_t N>
+class SPSC_ring
+{
+public:
+  static_assert((N & (N - 1)) == 0, "Ring size must be a power of two");
+
+  /** Returns false (and leaves @value alone) when the ring is full */
+  bool push(T&& value)
+  {
+    const size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N) return false;
+    slots[t & (N - 1)] = std::move(value);
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& value)
+  {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return false;
+    value = std::move(slots[h & (N - 1)]);
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const noexcept {
+    return head.load(std::memory_order_acquire)
+        == tail.load(std::memory_order_acquire);
+  }
+  size_t size() const noexcept {
+    return tail.load(std::memory_order_acquire)
+         - head.load(std::memory_order_acquire);
+  }
+  static constexpr size_t capacity() noexcept { return N; }
+
+private:
+  alignas(SMP_ALIGN) std::atomic<size_t> head {0};
+  alignas(SMP_ALIGN) std::atomic<size_t> tail {0};
+  T slots[N];
+};
+
+#endif
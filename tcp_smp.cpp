@@ -1,5 +1,10 @@
 #include "tcp_smp.hpp"
+#include "flow_table.hpp"
+#include "spsc_ring.hpp"
+#include "smp_queue.hpp"
 #include <net/inet4>
+#include <rtc>
+#include <algorithm>
 #define SMP_DEBUG 1
 #include <smp>
 
@@ -8,104 +13,308 @@
 
 typedef net::tcp::Connection::Tuple tuple_t;
 
+// packets handed over per ring before the producer must wait for a drain
+static const size_t RING_SIZE = 1024;
+
 struct alignas(SMP_ALIGN) TCP_SMP
 {
-  // initialize from given IP stack
-  void up(net::Inet<net::IP4>*);
+  // initialize from given IP stack, with an optional TX queue
+  void up(net::Inet<net::IP4>*, tcp_transmit_func);
   // handle redirected TCP traffic
   static void redirector(net::tcp::Packet_ptr);
   // TCP outgoing -> CPU 0 -> IP4 transmit
   void transmit(net::Packet_ptr);
+  // TCP outgoing -> this CPUs TX queue
+  void transmit_direct(net::Packet_ptr);
+  // TCP outgoing on the BSP -> IP4 transmit
+  void transmit_local(net::Packet_ptr);
+  // BSP -> this CPU, batched
+  void deliver(net::tcp::Packet_ptr);
+  // this CPUs RX queue -> TCP
+  void receive_direct(net::tcp::Packet_ptr);
 
   inline auto& tcp() { return *tcp_; }
+  const net::TCP* tcp_ptr() const noexcept { return tcp_.get(); }
+  const tcp_smp_stats& stats() const noexcept { return stats_; }
 private:
+  // run on this CPU: feed every queued packet to TCP
+  void rx_drain();
+  // run on CPU 0: transmit every queued packet
+  void tx_drain();
+
   net::IP4* ip4_out = nullptr;
+  tcp_transmit_func tx_queue = nullptr;
   std::unique_ptr<net::TCP> tcp_ = nullptr;
+  // a drain is pending, so producers don't need to signal again
+  std::atomic<bool> rx_scheduled {false};
+  std::atomic<bool> tx_scheduled {false};
+  SPSC_ring<net::tcp::Packet_ptr, RING_SIZE> rx_ring;
+  SPSC_ring<net::Packet_ptr, RING_SIZE> tx_ring;
+  tcp_smp_stats stats_;
 };
 static SMP_ARRAY<TCP_SMP> smp_system;
+static tcp_smp_options smp_options;
+static RSS_hasher      smp_rss;
 
 void TCP_SMP::transmit(net::Packet_ptr packet)
 {
-  // transport to CPU 0 and run it there
-  SMP::add_bsp_task(
-    SMP::task_func::make_packed(
-    [this, pkt = std::move(packet)] () mutable {
-      debug("Transmitting packet with len %u to %p\n", pkt->size(), ip4_out);
-      SET_CRASH("Transmitting packet %p with len %u", pkt->buf(), pkt->size());
-      ip4_out->transmit(std::move(pkt));
-    }));
+  stats_.worker.tx_packets++;
+  if (not tx_ring.push(std::move(packet))) {
+    stats_.worker.tx_drops++;
+    return;
+  }
+  // transport to CPU 0 and run it there, once per batch
+  if (not tx_scheduled.exchange(true))
+  {
+    stats_.worker.tx_signals++;
+    SMP_queue::add_bsp_task([this] { tx_drain(); });
+  }
+}
+
+void TCP_SMP::tx_drain()
+{
+  assert(SMP::cpu_id() == 0);
+  // clear first, so that a push racing with the drain schedules another
+  tx_scheduled.store(false);
+  stats_.bsp.tx_drains++;
+  net::Packet_ptr pkt;
+  while (tx_ring.pop(pkt))
+  {
+    debug("Transmitting packet with len %u to %p\n", pkt->size(), ip4_out);
+    SET_CRASH("Transmitting packet %p with len %u", pkt->buf(), pkt->size());
+    ip4_out->transmit(std::move(pkt));
+  }
+}
+
+void TCP_SMP::transmit_direct(net::Packet_ptr packet)
+{
+  stats_.worker.tx_direct++;
+  tx_queue(std::move(packet));
 }
 
-void TCP_SMP::up(net::Inet<net::IP4>* inet)
+void TCP_SMP::transmit_local(net::Packet_ptr packet)
+{
+  assert(SMP::cpu_id() == 0);
+  stats_.worker.tx_direct++;
+  ip4_out->transmit(std::move(packet));
+}
+
+void TCP_SMP::up(net::Inet<net::IP4>* inet, tcp_transmit_func queue)
 {
   debug("Creating TCP stack for CPU %d\n", SMP::cpu_id());
   ip4_out = &inet->ip_obj();
+  tx_queue = queue;
   tcp_.reset(new net::TCP(*inet, true));
-  tcp_->set_network_out({this, &TCP_SMP::transmit});
+  if (tx_queue)
+      tcp_->set_network_out({this, &TCP_SMP::transmit_direct});
+  else if (SMP::cpu_id() == 0)
+      tcp_->set_network_out({this, &TCP_SMP::transmit_local});
+  else
+      tcp_->set_network_out({this, &TCP_SMP::transmit});
+}
+
+void TCP_SMP::deliver(net::tcp::Packet_ptr packet)
+{
+  assert(SMP::cpu_id() == 0);
+  stats_.bsp.rx_packets++;
+  if (packet->isset(net::tcp::SYN) && not packet->isset(net::tcp::ACK))
+      stats_.bsp.accepts++;
+  // the BSPs own stack
+  if (this == &smp_system[0]) {
+    tcp().receive(std::move(packet));
+    return;
+  }
+  if (not rx_ring.push(std::move(packet))) {
+    // the worker is not keeping up, let TCP retransmit
+    stats_.bsp.rx_drops++;
+    return;
+  }
+  // only the first packet after a drain wakes the CPU
+  if (not rx_scheduled.exchange(true))
+  {
+    const int cpu = this - smp_system.data();
+    stats_.bsp.rx_signals++;
+    SMP_queue::add_task([this] { rx_drain(); }, cpu);
+  }
+}
+
+void TCP_SMP::rx_drain()
+{
+  assert(tcp().get_cpuid() == SMP::cpu_id());
+  rx_scheduled.store(false);
+  stats_.worker.rx_drains++;
+  net::tcp::Packet_ptr pkt;
+  while (rx_ring.pop(pkt))
+  {
+    SET_CRASH("BEFORE Calling TCP::receive, packet %p len = %u",
+              pkt->buf(), pkt->size());
+    tcp().receive(std::move(pkt));
+  }
+}
+
+void TCP_SMP::receive_direct(net::tcp::Packet_ptr packet)
+{
+  assert(tcp().get_cpuid() == SMP::cpu_id());
+  stats_.worker.rx_direct++;
+  // the NIC decides here, but it should agree with the fallback path
+  const tuple_t tuple { packet->destination(), packet->source() };
+  const int owner = smp_rss.cpu_for(tuple);
+  if (owner != SMP::cpu_id())
+  {
+    // the stack here does not know the flow and would reset it
+    stats_.worker.rx_misdirected++;
+    auto* raw = packet.release();
+    SMP_queue::add_task(
+    [raw, owner] () {
+      smp_system[owner].tcp().receive(net::tcp::Packet_ptr(raw));
+    }, owner);
+    return;
+  }
+  tcp().receive(std::move(packet));
 }
 
 static inline void guide(net::tcp::Packet_ptr packet, int cpu)
 {
   SET_CRASH("Moving incoming packet %p len = %u to cpu %d",
             packet->buf(), packet->size(), cpu);
-  SMP::add_task(
-  SMP::task_func::make_packed(
-    [cpu, pkt = std::move(packet)] () mutable {
-      assert(PER_CPU(smp_system).tcp().get_cpuid() == SMP::cpu_id());
-      assert(PER_CPU(smp_system).tcp().get_cpuid() == cpu);
-      SET_CRASH("BEFORE Calling TCP::receive, packet %p len = %u",
-                pkt->buf(), pkt->size());
-      PER_CPU(smp_system).tcp().receive(std::move(pkt));
-      SET_CRASH("AFTER Calling TCP::receive, packet %p len = %u",
-                pkt->buf(), pkt->size());
-    }), cpu);
-  SMP::signal(cpu);
+  smp_system[cpu].deliver(std::move(packet));
 }
 
+// 16k buckets * 4 flows = 64k concurrent flows in 1 MB, to start with,
+// and at most 512k flows in 8 MB
+static const uint32_t FLOW_BUCKETS     = 16384;
+static const uint32_t FLOW_MAX_BUCKETS = 131072;
+// longer than the two hours TCP keepalive waits before probing
+static const uint16_t FLOW_IDLE        = 3 * 3600;
+static const uint16_t FLOW_TIME_WAIT   = 60;
+
 void TCP_SMP::redirector(net::tcp::Packet_ptr packet)
 {
   debug("<redirector> Packet received - Source: %s, Destination: %s\n",
         packet->source().to_string().c_str(), packet->destination().to_string().c_str());
 
-  static std::map<tuple_t, int> routes;
   const tuple_t tuple { packet->destination(), packet->source() };
+  if (smp_options.steering == tcp_smp_options::RSS)
+  {
+    // no per-flow state: the hash alone decides
+    guide(std::move(packet), smp_rss.cpu_for(tuple));
+    return;
+  }
+
+  static Flow_table routes(FLOW_BUCKETS, FLOW_MAX_BUCKETS, FLOW_IDLE, FLOW_TIME_WAIT);
+  const uint16_t now = RTC::now();
 
-  auto it = routes.find(tuple);
-  if (it != routes.end())
+  int cpu = routes.lookup(tuple, now);
+  if (cpu >= 0)
   {
     debug("<redirector> Sending %s to %d\n",
-            packet->source().to_string().c_str(), it->second);
-    guide(std::move(packet), it->second);
+            packet->source().to_string().c_str(), cpu);
+    // forget the flow once the remote is done with it
+    if (packet->isset(net::tcp::RST))
+        routes.erase(tuple);
+    else if (packet->isset(net::tcp::FIN))
+        routes.closing(tuple, now);
+    guide(std::move(packet), cpu);
     return;
   }
 
   debug("<redirector> Assigning new route for: %s\n",
           packet->source().to_string().c_str());
   // round-robin select vcpu
-  static int next_cpu = 1;
-  int current_cpu = next_cpu++;
-  if (next_cpu >= SMP::cpu_count()) next_cpu = 1;
+  static size_t next_cpu = 0;
+  int current_cpu = smp_options.cpus[next_cpu++];
+  if (next_cpu >= smp_options.cpus.size()) next_cpu = 0;
 
-  // assign new route
-  routes[tuple] = current_cpu;
+  // assign new route, unless the remote is resetting a flow we dont know
+  if (not packet->isset(net::tcp::RST)) {
+    // full of established flows: the remote retries its SYN later
+    if (not routes.insert(tuple, current_cpu, now)) return;
+  }
   guide(std::move(packet), current_cpu);
 }
 
-void init_tcp_smp_system(ip4_stack& inet, tcp_service_func func)
+void init_tcp_smp_system(ip4_stack& inet, tcp_service_func func,
+                         tcp_smp_options options)
 {
+  if (options.cpus.empty()) {
+    for (int cpu = 1; cpu < SMP::cpu_count(); cpu++)
+        options.cpus.push_back(cpu);
+  }
+  if (options.include_bsp &&
+      std::find(options.cpus.begin(), options.cpus.end(), 0) == options.cpus.end())
+      options.cpus.insert(options.cpus.begin(), 0);
+  assert(not options.cpus.empty());
+  smp_options = std::move(options);
+  smp_rss.set_key(smp_options.rss_key);
+  smp_rss.set_cpus(smp_options.cpus);
+
+  // a single queue is the one the BSP already transmits on
+  const bool per_cpu_tx = smp_options.tx_queues.size() > 1;
+  if (per_cpu_tx) {
+    assert(smp_options.tx_queues.size() >= smp_options.cpus.size());
+  }
+  // flows must land on the same CPU whichever queue they arrive on
+  if (smp_options.rx_queue_bind) {
+    assert(smp_options.steering == tcp_smp_options::RSS);
+  }
+
   // start all the TCPs
-  for (int cpu = 1; cpu < SMP::cpu_count(); cpu++)
+  for (size_t i = 0; i < smp_options.cpus.size(); i++)
   {
-    SMP::add_task(
-    SMP::task_func::make_packed(
-      [cpu, network = &inet, func] () {
+    const int cpu = smp_options.cpus[i];
+    tcp_transmit_func queue = nullptr;
+    if (per_cpu_tx) queue = smp_options.tx_queues[i];
+
+    auto task =
+      [i, network = &inet, func, queue] () {
         SET_CRASH("Creating TCP system");
-        PER_CPU(smp_system).up(network);
+        auto& system = PER_CPU(smp_system);
+        system.up(network, queue);
+        if (smp_options.rx_queue_bind)
+            smp_options.rx_queue_bind(i, {&system, &TCP_SMP::receive_direct});
         SET_CRASH("Calling TCP over SMP user delegate for service code");
-        func(PER_CPU(smp_system).tcp());
-      }), cpu);
+        func(system.tcp());
+      };
+    // we are on the BSP already
+    if (cpu == 0) {
+      task();
+      continue;
+    }
+    SMP::add_task(SMP::task_func::make_packed(std::move(task)), cpu);
     SMP::signal(cpu);
   }
   // redirect inets TCP traffic to our guide
   inet.tcp().redirect(TCP_SMP::redirector);
 }
+
+bool tcp_smp_owns(const net::TCP& tcp)
+{
+  for (int cpu : smp_options.cpus)
+    if (smp_system[cpu].tcp_ptr() == &tcp) return true;
+  return false;
+}
+
+tcp_smp_stats tcp_smp_get_stats(int cpu)
+{
+  return smp_system.at(cpu).stats();
+}
+
+void tcp_smp_print_stats()
+{
+  for (int cpu : smp_options.cpus)
+  {
+    const auto& bsp = smp_system[cpu].stats().bsp;
+    const auto& wrk = smp_system[cpu].stats().worker;
+    printf("TCP SMP CPU %d: %llu accepts | rx %llu pkts %llu IPIs (%.1f pkts/IPI) %llu drops"
+           " %llu direct (%llu misdirected)"
+           " | tx %llu pkts %llu IPIs (%.1f pkts/IPI) %llu drops %llu direct\n", cpu,
+           (unsigned long long) bsp.accepts,
+           (unsigned long long) bsp.rx_packets, (unsigned long long) bsp.rx_signals,
+           bsp.rx_signals ? (double) bsp.rx_packets / bsp.rx_signals : 0.0,
+           (unsigned long long) bsp.rx_drops,
+           (unsigned long long) wrk.rx_direct, (unsigned long long) wrk.rx_misdirected,
+           (unsigned long long) wrk.tx_packets, (unsigned long long) wrk.tx_signals,
+           wrk.tx_signals ? (double) wrk.tx_packets / wrk.tx_signals : 0.0,
+           (unsigned long long) wrk.tx_drops, (unsigned long long) wrk.tx_direct);
+  }
+}
@@ -1,7 +1,88 @@
 #pragma once
 #include <net/inet>
+#include <smp>
+#include <net/tcp/packet.hpp>
+#include "rss.hpp"
 
-using tcp_service_func = delegate<void(net::TCP&)>;
-using ip4_stack        = net::Inet<net::IP4>;
+using tcp_service_func  = delegate<void(net::TCP&)>;
+using tcp_transmit_func = delegate<void(net::Packet_ptr)>;
+using tcp_receive_func  = delegate<void(net::tcp::Packet_ptr)>;
+using ip4_stack         = net::Inet<net::IP4>;
 
-void init_tcp_smp_system(ip4_stack&, tcp_service_func);
+struct tcp_smp_options
+{
+  enum steering_t {
+    // remember a round-robin choice per flow in the BSP flow table
+    ROUND_ROBIN,
+    // stateless Toeplitz hash of the 4-tuple, deterministic across restarts
+    RSS
+  };
+  steering_t steering = ROUND_ROBIN;
+  // hash key used in RSS mode
+  RSS_hasher::key_t rss_key = RSS_hasher::default_key();
+  // CPUs running a TCP stack, empty means every CPU except the BSP
+  std::vector<int> cpus;
+  // The BSP also runs a TCP stack and the service, next to @cpus.
+  // Its flows are handed over without a ring or an IPI.
+  bool include_bsp = false;
+  // Per-CPU transmit queues, one for each entry in @cpus, taking packets
+  // the way IP4::transmit does (eg. a multi-queue NIC TX queue with its
+  // own IP4 shim). A worker with a queue transmits directly from its own
+  // CPU; with one or no queues all egress is funneled through the BSP.
+  std::vector<tcp_transmit_func> tx_queues;
+  // Per-CPU receive queues. Called on each worker with its index in @cpus
+  // and the handler that queue's TCP packets should go to, so that those
+  // flows never touch CPU 0. The BSP redirector remains as the fallback
+  // for the default queue. Requires RSS steering, with the NIC using the
+  // same key and indirection table (see RSS_hasher).
+  delegate<void(int queue, tcp_receive_func)> rx_queue_bind = nullptr;
+};
+
+/**
+ * Runs @func on every TCP CPU with that CPU's own TCP stack, eg. to start
+ * a server. Each CPU listens on the same ports, and every new connection
+ * is given to exactly one of them, much like SO_REUSEPORT: a shared-nothing
+ * setup where connections never leave the CPU that accepted them.
+**/
+void init_tcp_smp_system(ip4_stack&, tcp_service_func,
+                         tcp_smp_options = tcp_smp_options{});
+
+/** Whether @tcp is one of the per-CPU stacks */
+bool tcp_smp_owns(const net::TCP& tcp);
+
+/**
+ * Counters for one CPU, in two halves: those written by the BSP and
+ * those written by the worker itself, each on cache lines of its own.
+**/
+struct tcp_smp_stats
+{
+  struct alignas(SMP_ALIGN) bsp_t
+  {
+    // BSP -> worker, signals are drain requests (see SMP_queue for IPIs)
+    uint64_t rx_packets = 0;
+    uint64_t rx_signals = 0;
+    uint64_t rx_drops   = 0;
+    // worker -> BSP, drained on the BSP
+    uint64_t tx_drains  = 0;
+    // connection attempts (SYNs) given to this CPU
+    uint64_t accepts    = 0;
+  } bsp;
+
+  struct alignas(SMP_ALIGN) worker_t
+  {
+    uint64_t rx_drains  = 0;
+    // worker -> BSP
+    uint64_t tx_packets = 0;
+    uint64_t tx_signals = 0;
+    uint64_t tx_drops   = 0;
+    // own RX queue -> worker, and packets the NIC steered to the
+    // wrong CPU, which are passed on to the right one
+    uint64_t rx_direct  = 0;
+    uint64_t rx_misdirected = 0;
+    // worker -> own TX queue
+    uint64_t tx_direct  = 0;
+  } worker;
+};
+
+tcp_smp_stats tcp_smp_get_stats(int cpu);
+void tcp_smp_print_stats();
@@ -0,0 +1,122 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2017 Oslo and Akershus University College of Applied Sciences
+// and Alfred Bratterud
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tls_session_cache.hpp"
+
+// ~2 KB per session without client certificates
+static const size_t DEFAULT_MAX_SESSIONS = 16384;
+static const std::chrono::hours DEFAULT_LIFETIME {2};
+
+TLS_session_cache& TLS_session_cache::get()
+{
+  static TLS_session_cache cache(DEFAULT_MAX_SESSIONS, DEFAULT_LIFETIME);
+  return cache;
+}
+
+TLS_session_cache::TLS_session_cache(size_t max_sessions,
+                                     std::chrono::seconds life)
+  : max_per_shard(std::max<size_t>(1, max_sessions / SMP_MAX_CORES)),
+    lifetime(life)
+{}
+
+bool TLS_session_cache::load_from_session_id(
+      const std::vector<uint8_t>& session_id,
+      Botan::TLS::Session& session)
+{
+  lookups++;
+  const auto key = make_key(session_id);
+  auto& shard = shard_for(key);
+
+  lock(shard.lock);
+  auto it = shard.sessions.find(key);
+  if (it == shard.sessions.end()) {
+    unlock(shard.lock);
+    return false;
+  }
+  // expired sessions are forgotten on lookup
+  if (std::chrono::system_clock::now() - it->second.start_time() > lifetime) {
+    shard.sessions.erase(it);
+    unlock(shard.lock);
+    return false;
+  }
+  session = it->second;
+  unlock(shard.lock);
+  hits++;
+  return true;
+}
+
+void TLS_session_cache::remove_entry(const std::vector<uint8_t>& session_id)
+{
+  const auto key = make_key(session_id);
+  auto& shard = shard_for(key);
+  lock(shard.lock);
+  shard.sessions.erase(key);
+  unlock(shard.lock);
+}
+
+size_t TLS_session_cache::remove_all()
+{
+  size_t count = 0;
+  for (auto& shard : shards)
+  {
+    lock(shard.lock);
+    count += shard.sessions.size();
+    shard.sessions.clear();
+    shard.order.clear();
+    unlock(shard.lock);
+  }
+  return count;
+}
+
+void TLS_session_cache::save(const Botan::TLS::Session& session)
+{
+  if (session.session_id().empty()) return;
+  saves++;
+  const auto key = make_key(session.session_id());
+  auto& shard = shard_for(key);
+
+  lock(shard.lock);
+  while (shard.sessions.size() >= max_per_shard && not shard.order.empty())
+  {
+    if (shard.sessions.erase(shard.order.front())) evictions++;
+    shard.order.pop_front();
+  }
+  // keys that were removed early would otherwise pile up
+  if (shard.order.size() > 2 * max_per_shard)
+  {
+    std::deque<key_t> live;
+    for (auto& k : shard.order)
+      if (shard.sessions.count(k)) live.push_back(std::move(k));
+    shard.order.swap(live);
+  }
+  auto res = shard.sessions.emplace(key, session);
+  if (res.second)
+      shard.order.push_back(key);
+  else
+      res.first->second = session;
+  unlock(shard.lock);
+}
+
+TLS_session_cache::stats_t TLS_session_cache::get_stats() const noexcept
+{
+  stats_t st;
+  st.lookups   = lookups.load();
+  st.hits      = hits.load();
+  st.saves     = saves.load();
+  st.evictions = evictions.load();
+  return st;
+}
@@ -0,0 +1,96 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2017 Oslo and Akershus University College of Applied Sciences
+// and Alfred Bratterud
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#ifndef TLS_SESSION_CACHE_HPP
+#define TLS_SESSION_CACHE_HPP
+
+#include <botan/tls_session_manager.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+#include <smp>
+
+/**
+ * @brief      Bounded TLS session cache shared by every worker CPU.
+ *
+ *             Sessions are sharded by session ID, one shard per CPU slot,
+ *             each behind its own spinlock, so a client resuming on a
+ *             different CPU than it first connected to still hits.
+ *             Each shard evicts its oldest session when full.
+ */
+class TLS_session_cache : public Botan::TLS::Session_Manager
+{
+public:
+  struct stats_t {
+    uint64_t lookups   = 0;
+    uint64_t hits      = 0;
+    uint64_t saves     = 0;
+    uint64_t evictions = 0;
+  };
+
+  TLS_session_cache(size_t max_sessions, std::chrono::seconds lifetime);
+
+  bool load_from_session_id(const std::vector<uint8_t>& session_id,
+                            Botan::TLS::Session& session) override;
+
+  // only used by TLS clients
+  bool load_from_server_info(const Botan::TLS::Server_Information&,
+                             Botan::TLS::Session&) override
+  { return false; }
+
+  void remove_entry(const std::vector<uint8_t>& session_id) override;
+
+  size_t remove_all() override;
+
+  void save(const Botan::TLS::Session& session) override;
+
+  std::chrono::seconds session_lifetime() const override
+  { return lifetime; }
+
+  stats_t get_stats() const noexcept;
+
+  /** The cache shared by all TLS SMP servers */
+  static TLS_session_cache& get();
+
+private:
+  using key_t = std::string;
+  struct alignas(SMP_ALIGN) shard_t
+  {
+    spinlock_t lock = 0;
+    std::unordered_map<key_t, Botan::TLS::Session> sessions;
+    // insertion order, for eviction (may hold removed keys)
+    std::deque<key_t> order;
+  };
+  static key_t make_key(const std::vector<uint8_t>& id) {
+    return key_t(id.begin(), id.end());
+  }
+  shard_t& shard_for(const key_t& key) {
+    return shards[std::hash<key_t>{}(key) % shards.size()];
+  }
+
+  SMP_ARRAY<shard_t> shards;
+  const size_t max_per_shard;
+  const std::chrono::seconds lifetime;
+  std::atomic<uint64_t> lookups {0};
+  std::atomic<uint64_t> hits {0};
+  std::atomic<uint64_t> saves {0};
+  std::atomic<uint64_t> evictions {0};
+};
+
+#endif
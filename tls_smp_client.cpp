@@ -1,7 +1,35 @@
 #include "tls_smp_client.hpp"
+#include <algorithm>
+#include <timers>
 
 using namespace net::tls;
 
+// streams with a batch waiting, per TCP CPU
+struct alignas(SMP_ALIGN) flush_list_t
+{
+  std::vector<SMP_client*> clients;
+  bool scheduled = false;
+};
+static SMP_ARRAY<flush_list_t> flush_lists;
+
+// idle streams that have traffic again, per TCP CPU
+struct alignas(SMP_ALIGN) wake_list_t
+{
+  std::vector<SMP_client*> clients;
+  bool scheduled = false;
+};
+static SMP_ARRAY<wake_list_t> wake_lists;
+
+// every stream on a TCP CPU, when the idle sweep is on
+struct alignas(SMP_ALIGN) idle_list_t
+{
+  std::vector<SMP_client*> clients;
+  bool scheduled = false;
+};
+static SMP_ARRAY<idle_list_t> idle_lists;
+// a stream goes idle after this many sweeps without traffic
+static const uint8_t IDLE_SWEEPS = 4;
+
 void SMP_TLS_State::read(tcp::buffer_t buff)
 {
   TLS_PRINT("TLS %d recv: process %lu bytes on CPU %d\n",
@@ -9,108 +37,208 @@ void SMP_TLS_State::read(tcp::buffer_t buff)
   assert(SMP::cpu_id() == this->system_cpu);
   try
   {
-    int rem = m_tls.received_data(buff->data(), buff->size());
-    TLS_PRINT("TLS %d finished processing, %u rem\n",
-              this->stream_id, rem);
-    (void) rem;
-  }
-  catch(Botan::Exception& e)
-  {
-    TLS_ALWAYS_PRINT("TLS %d: TLS recv error %s\n",
-              this->stream_id, e.what());
-    this->close();
+    m_engine->received(buff->data(), buff->size());
+    TLS_PRINT("TLS %d finished processing\n", this->stream_id);
+    this->flush();
+    // answered with our own close_notify
+    if (this->peer_closed) this->close();
   }
   catch(std::exception& e)
   {
     TLS_ALWAYS_PRINT("TLS %d: TLS recv error %s!\n",
             this->stream_id, e.what());
+    // the alert the engine emitted goes out before the connection closes
+    this->flush();
     this->close();
   }
 }
 
 void SMP_TLS_State::write(tcp::buffer_t buff)
+{
+  this->write(buff->data(), buff->size());
+}
+
+void SMP_TLS_State::write(const uint8_t* data, size_t len)
 {
   TLS_PRINT("TLS %d write(): tls_send called on %d\n",
             this->get_id(), SMP::cpu_id());
   //assert(this->active);
+  tls_smp_get_stats(SMP::cpu_id()).messages++;
   try
   {
-    m_tls.send(buff->data(), buff->size());
+    m_engine->send(data, len);
+    this->flush();
   }
-  catch(Botan::Exception& e)
+  catch(std::exception& e)
   {
-    TLS_ALWAYS_PRINT("TLS %d: TLS send error %s\n",
-              this->stream_id, e.what());
+    TLS_ALWAYS_PRINT("TLS %d: TLS send error %s!\n",
+            this->stream_id, e.what());
+    // the alert the engine emitted goes out before the connection closes
+    this->flush();
     this->close();
   }
+}
+
+void SMP_TLS_State::write(const std::vector<tcp::buffer_t>& segs)
+{
+  tls_smp_get_stats(SMP::cpu_id()).messages++;
+  try
+  {
+    iovec iov[16];
+    size_t count = 0;
+    for (const auto& seg : segs)
+    {
+      iov[count++] = { seg->data(), seg->size() };
+      if (count == 16) {
+        m_engine->sendv(iov, count);
+        count = 0;
+      }
+    }
+    if (count) m_engine->sendv(iov, count);
+    this->flush();
+  }
   catch(std::exception& e)
   {
     TLS_ALWAYS_PRINT("TLS %d: TLS send error %s!\n",
             this->stream_id, e.what());
+    // the alert the engine emitted goes out before the connection closes
+    this->flush();
     this->close();
   }
 }
 
 void SMP_TLS_State::close()
 {
-  assert(SMP::cpu_id() != 0);
+  assert(SMP::cpu_id() == this->system_cpu);
+  if (this->closed) return;
+  this->closed = true;
   TLS_ALWAYS_PRINT("TLS %d close called on %d\n",
             this->stream_id, SMP::cpu_id());
-  SMP::add_bsp_task(
-  [this] () {
-    stream.close();
+  // close_notify goes out ahead of the close, which waits for it
+  try
+  {
+    m_engine->close();
+  }
+  catch(std::exception&)
+  {
+    // the engine already failed, there is nothing more to send
+  }
+  this->flush();
+  // the engine may have to hide when it failed
+  const auto delay = m_engine->close_delay();
+  tls_smp_run(stream.tcp_cpu,
+  [this, delay] () {
+    if (delay.count() > 0)
+        stream.close_later(delay);
+    else
+        stream.close();
   });
 }
 
-
-void SMP_TLS_State::tls_emit_data(const uint8_t buf[], size_t len)
+void SMP_TLS_State::release_buffers()
 {
-  TLS_PRINT("TLS %d emit %lu bytes on %d\n",
-            this->stream_id, len, SMP::cpu_id());
   assert(SMP::cpu_id() == this->system_cpu);
+  assert(m_emit == nullptr && m_recv == nullptr);
+  m_engine->release_buffers();
+}
 
-  auto buff = tcp::construct_buffer(buf, buf + len);
-  // run on main CPU
-  SMP::add_bsp_task(
-  [this, buf = std::move(buff)] () {
-    TLS_PRINT("TLS %d TCP write() %lu (writable=%d) on %d\n",
-              this->stream_id, buf->size(), stream.is_writable(), SMP::cpu_id());
-    stream.bsp_write(std::move(buf));
-  });
+void SMP_TLS_State::move_to(int cpu)
+{
+  TLS_PRINT("TLS %d moving from CPU %d to %d\n",
+            this->stream_id, SMP::cpu_id(), cpu);
+  assert(SMP::cpu_id() == this->system_cpu);
+  // every call into the engine ends with a flush
+  assert(m_emit == nullptr && m_recv == nullptr);
+  tls_smp_get_stats(SMP::cpu_id()).migrations++;
+  this->system_cpu = cpu;
 }
 
-void SMP_TLS_State::tls_record_received(
-          uint64_t, const uint8_t buf[], size_t len)
+void SMP_TLS_State::tls_emit(const uint8_t buf[], size_t len)
 {
-  TLS_PRINT("TLS %d tls record %lu bytes on %d\n",
+  TLS_PRINT("TLS %d emit %lu bytes on %d\n",
             this->stream_id, len, SMP::cpu_id());
   assert(SMP::cpu_id() == this->system_cpu);
-  assert(this->active);
 
-  if (o_read)
+  auto& stats = tls_smp_get_stats(SMP::cpu_id());
+  if (m_emit == nullptr) {
+    m_emit = buffer_pool::get(std::max(len, (size_t) 2048));
+    stats.buffers_allocated++;
+  }
+  m_emit->insert(m_emit->end(), buf, buf + len);
+  stats.bytes_copied += len;
+}
+
+void SMP_TLS_State::flush()
+{
+  // posted, not run here, even on the TCP CPU: both end up in user
+  // callbacks, and those may delete the stream from under the engine
+  if (m_emit != nullptr)
+  {
+    stream.m_in_transit += m_emit->size();
+    tls_smp_post(stream.tcp_cpu,
+    [this, buf = std::move(m_emit)] () {
+      TLS_PRINT("TLS %d TCP write() %lu (writable=%d) on %d\n",
+                this->stream_id, buf->size(), stream.is_writable(), SMP::cpu_id());
+      stream.bsp_write(std::move(buf));
+    });
+    m_emit = nullptr;
+  }
+  if (m_recv != nullptr)
   {
-    auto buff = tcp::construct_buffer(buf, buf + len);
-    // run on main CPU
-    SMP::add_bsp_task(
-    [this, buf = std::move(buff)] () {
+    tls_smp_post(stream.tcp_cpu,
+    [this, buf = std::move(m_recv)] () {
       if (o_read) {
         TLS_PRINT("TLS %d calling on_read on %d\n",
                   this->stream_id, SMP::cpu_id());
         o_read(std::move(buf));
       }
     });
+    m_recv = nullptr;
   }
 }
 
-void SMP_TLS_State::tls_session_activated()
+void SMP_TLS_State::tls_record(const uint8_t buf[], size_t len)
+{
+  TLS_PRINT("TLS %d tls record %lu bytes on %d\n",
+            this->stream_id, len, SMP::cpu_id());
+  assert(SMP::cpu_id() == this->system_cpu);
+  assert(this->active);
+
+  if (o_read)
+  {
+    auto& stats = tls_smp_get_stats(SMP::cpu_id());
+    stats.messages++;
+    if (m_recv == nullptr) {
+      m_recv = buffer_pool::get(std::max(len, (size_t) 2048));
+      stats.buffers_allocated++;
+    }
+    m_recv->insert(m_recv->end(), buf, buf + len);
+    stats.bytes_copied += len;
+  }
+}
+
+void SMP_TLS_State::tls_activated(bool resumed)
 {
   TLS_PRINT("TLS %d session connected on %d\n",
             this->stream_id, SMP::cpu_id());
   assert(SMP::cpu_id() == this->system_cpu);
   this->active = true; // ACTIVATE!
+  auto& stats = tls_smp_get_stats(SMP::cpu_id());
+  stats.handshakes++;
+  if (not resumed) stats.full_handshakes++;
+  stream.handshake_finished();
 
+  // leave the handshake CPU, ordered before on_connect
+  if (stream.data_cpus) {
+    tls_smp_run(stream.tcp_cpu,
+    [this] () {
+      stream.migrate();
+    });
+  }
+
+  // called from inside the engine, so never inline
   if (o_connect) {
-    SMP::add_bsp_task(
+    tls_smp_post(stream.tcp_cpu,
     [this] () {
       if (o_connect) {
         TLS_PRINT("TLS %d calling on_connect on %d\n",
@@ -120,3 +248,245 @@ void SMP_TLS_State::tls_session_activated()
     });
   }
 }
+
+void SMP_TLS_State::tls_closed()
+{
+  assert(SMP::cpu_id() == this->system_cpu);
+  // closed once the engine call returns, see read()
+  this->peer_closed = true;
+}
+
+void SMP_client::coalesce(const void* data, size_t len)
+{
+  assert(SMP::cpu_id() == this->tcp_cpu);
+  const size_t limit = tls_smp_get_coalescing().max_bytes;
+  if (batched() > 0 && batched() + len > limit)
+      this->flush_writes();
+
+  auto& stats = tls_smp_get_stats(SMP::cpu_id());
+  if (m_batch == nullptr) {
+    m_batch = buffer_pool::get(limit);
+    stats.buffers_allocated++;
+  }
+  auto* bytes = (const uint8_t*) data;
+  m_batch->insert(m_batch->end(), bytes, bytes + len);
+  stats.bytes_copied += len;
+  stats.writes_coalesced++;
+  this->schedule_flush();
+  this->check_watermarks();
+}
+
+void SMP_client::writev(const buffer_t* bufs, size_t count)
+{
+  assert(SMP::cpu_id() == this->tcp_cpu);
+  size_t len = 0;
+  for (size_t i = 0; i < count; i++) len += bufs[i]->size();
+
+  const size_t limit = tls_smp_get_coalescing().max_bytes;
+  if (batched() > 0 && batched() + len > limit)
+      this->flush_writes();
+  // copies made so far go first
+  if (m_batch != nullptr) {
+    m_segment_bytes += m_batch->size();
+    m_segments.push_back(std::move(m_batch));
+    m_batch = nullptr;
+  }
+  if (m_segments.empty()) m_segments.reserve(16);
+  m_segments.insert(m_segments.end(), bufs, bufs + count);
+  m_segment_bytes += len;
+
+  auto& stats = tls_smp_get_stats(SMP::cpu_id());
+  stats.writes_coalesced++;
+  stats.segments_gathered += count;
+  if (batched() >= limit)
+      this->flush_writes();
+  else
+      this->schedule_flush();
+  this->check_watermarks();
+}
+
+void SMP_client::flush_writes()
+{
+  if (m_batch == nullptr && m_segments.empty()) return;
+  tls_smp_get_stats(SMP::cpu_id()).write_batches++;
+  if (m_segments.empty()) {
+    auto batch = std::move(m_batch);
+    m_batch = nullptr;
+    this->send_plaintext(std::move(batch));
+    return;
+  }
+  if (m_batch != nullptr) {
+    m_segment_bytes += m_batch->size();
+    m_segments.push_back(std::move(m_batch));
+    m_batch = nullptr;
+  }
+  const int64_t len = m_segment_bytes;
+  auto segs = std::move(m_segments);
+  m_segments.clear();
+  m_segment_bytes = 0;
+  this->send_segments(std::move(segs), len);
+}
+
+void SMP_client::send_segments(std::vector<buffer_t> segs, int64_t len)
+{
+  assert(tls_state != nullptr);
+  assert(tls_state->is_active());
+  const int cpu = this->system_cpu;
+  if (not is_affine())
+      tls_smp_get_load(cpu).queued_bytes += len;
+  m_in_transit += len;
+  run_on_tls(
+  [this, segs = std::move(segs), len, cpu] () {
+    tls_state->write(segs);
+    this->plaintext_done(len);
+    if (cpu != tcp_cpu)
+        tls_smp_get_load(cpu).queued_bytes -= len;
+  });
+  this->check_watermarks();
+}
+
+void SMP_client::close_later(std::chrono::milliseconds delay)
+{
+  assert(SMP::cpu_id() == this->tcp_cpu);
+  if (m_close_timer != Timers::UNUSED_ID) return;
+  m_close_timer = Timers::oneshot(delay,
+  [this] (int) {
+    m_close_timer = Timers::UNUSED_ID;
+    this->close();
+  });
+}
+
+void SMP_client::schedule_flush()
+{
+  if (this->flush_queued) return;
+  this->flush_queued = true;
+  auto& fl = PER_CPU(flush_lists);
+  fl.clients.push_back(this);
+  if (fl.scheduled) return;
+  fl.scheduled = true;
+
+  const auto delay = tls_smp_get_coalescing().delay;
+  if (delay.count() == 0) {
+    // behind whatever this CPU is doing right now
+    SMP_queue::add_task([] () { SMP_client::flush_all(); }, SMP::cpu_id());
+  }
+  else {
+    Timers::oneshot(delay, [] (int) { SMP_client::flush_all(); });
+  }
+}
+
+void SMP_client::unschedule_flush()
+{
+  auto& clients = PER_CPU(flush_lists).clients;
+  auto it = std::find(clients.begin(), clients.end(), this);
+  if (it != clients.end()) *it = nullptr;
+  this->flush_queued = false;
+}
+
+void SMP_client::flush_all()
+{
+  auto& fl = PER_CPU(flush_lists);
+  // streams may be added or closed while flushing
+  for (size_t i = 0; i < fl.clients.size(); i++)
+  {
+    auto* client = fl.clients[i];
+    if (client == nullptr) continue;
+    client->flush_queued = false;
+    client->flush_writes();
+  }
+  fl.clients.clear();
+  fl.scheduled = false;
+}
+
+void SMP_client::track_idle()
+{
+  const auto timeout = tls_smp_get_idle().timeout;
+  if (timeout.count() == 0) return;
+  auto& il = PER_CPU(idle_lists);
+  this->m_idle_slot = il.clients.size();
+  il.clients.push_back(this);
+  if (il.scheduled) return;
+  il.scheduled = true;
+  Timers::oneshot(timeout / IDLE_SWEEPS, [] (int) { SMP_client::idle_sweep(); });
+}
+
+void SMP_client::untrack_idle()
+{
+  assert(SMP::cpu_id() == this->tcp_cpu);
+  auto& clients = PER_CPU(idle_lists).clients;
+  assert(clients.at(m_idle_slot) == this);
+  auto* last = clients.back();
+  clients[m_idle_slot] = last;
+  last->m_idle_slot = m_idle_slot;
+  clients.pop_back();
+  this->m_idle_slot = NO_IDLE_SLOT;
+}
+
+void SMP_client::wake()
+{
+  tls_smp_get_stats(SMP::cpu_id()).idle_wakeups++;
+  this->m_idle = false;
+  this->m_waking = true;
+  auto& wl = PER_CPU(wake_lists);
+  wl.clients.push_back(this);
+  if (wl.scheduled) return;
+  wl.scheduled = true;
+  SMP_queue::add_task([] () { SMP_client::wake_all(); }, SMP::cpu_id());
+}
+
+void SMP_client::unschedule_wake()
+{
+  auto& clients = PER_CPU(wake_lists).clients;
+  auto it = std::find(clients.begin(), clients.end(), this);
+  if (it != clients.end()) *it = nullptr;
+  this->m_waking = false;
+}
+
+void SMP_client::wake_all()
+{
+  auto& wl = PER_CPU(wake_lists);
+  for (size_t i = 0; i < wl.clients.size(); i++)
+  {
+    auto* client = wl.clients[i];
+    if (client == nullptr) continue;
+    client->m_waking = false;
+    // the TLS engine grows back by itself
+    client->tcp->on_read(client->m_read_size, {client, &SMP_client::bsp_read});
+  }
+  wl.clients.clear();
+  wl.scheduled = false;
+}
+
+void SMP_client::idle_tick()
+{
+  // stays small until the next packet, see bsp_read()
+  if (this->m_idle) return;
+  if (++this->m_quiet < IDLE_SWEEPS) return;
+  // only when nothing is on its way anywhere
+  if (tls_state == nullptr || not tls_state->is_active() || m_migration != nullptr
+      || send_queued() > 0 || this->close_pending
+      || not tcp->is_connected()) return;
+
+  this->m_idle = true;
+  tls_smp_get_stats(SMP::cpu_id()).idle_releases++;
+  tcp->on_read(tls_smp_get_idle().read_size, {this, &SMP_client::bsp_read});
+  std::vector<buffer_t>().swap(m_segments);
+  run_on_tls(
+  [this] () {
+    tls_state->release_buffers();
+  });
+}
+
+void SMP_client::idle_sweep()
+{
+  auto& il = PER_CPU(idle_lists);
+  // streams may close while sweeping, and swap places in the list
+  for (size_t i = 0; i < il.clients.size(); i++)
+      il.clients[i]->idle_tick();
+  if (il.clients.empty()) {
+    il.scheduled = false;
+    return;
+  }
+  const auto timeout = tls_smp_get_idle().timeout;
+  Timers::oneshot(timeout / IDLE_SWEEPS, [] (int) { SMP_client::idle_sweep(); });
+}
@@ -19,13 +19,13 @@
 #ifndef NET_TLS_SMP_STREAM_HPP
 #define NET_TLS_SMP_STREAM_HPP
 
-#include <botan/credentials_manager.h>
-#include <botan/rng.h>
-#include <botan/tls_server.h>
-#include <botan/tls_callbacks.h>
 #include <net/tcp/connection.hpp>
-#include <net/tls/credman.hpp>
+#include <timers>
+#include <vector>
 #include "tls_smp_system.hpp"
+#include "tls_smp_engine.hpp"
+#include "buffer_pool.hpp"
+#include "gather_stream.hpp"
 
 namespace net
 {
@@ -33,22 +33,19 @@ namespace tls
 {
 class SMP_client;
 
-class SMP_TLS_State : public Botan::TLS::Callbacks {
+class SMP_TLS_State : public TLS_SMP_engine::Output {
 public:
   using Connection_ptr = tcp::Connection_ptr;
 
   SMP_TLS_State(
         SMP_client& in_stream,
-        Botan::RandomNumberGenerator& rng,
-        Botan::Credentials_Manager& credman)
+        tls_smp_system& system)
   : stream(in_stream),
-    m_creds(credman),
-    m_session_manager(),
-    m_tls(*this, m_session_manager, m_creds, m_policy, rng),
     system_cpu(SMP::cpu_id())
   {
     static int N = 0;
     stream_id = N++;
+    m_engine = system.make_engine(*this);
     TLS_PRINT("TLS stream %d constructed on %d\n",
               this->stream_id, SMP::cpu_id());
   }
@@ -72,103 +69,174 @@ public:
     o_read    = nullptr;
   }
 
+  // hand this state over to @cpu, which runs everything from now on
+  void move_to(int cpu);
+
   void read(tcp::buffer_t buff);
 
   void write(tcp::buffer_t buff);
+  void write(const uint8_t* data, size_t len);
+  // @segs encrypted as one, see TLS_SMP_engine::sendv()
+  void write(const std::vector<tcp::buffer_t>& segs);
 
   // close from TLS-side
   void close();
 
-protected:
-  void tls_alert(Botan::TLS::Alert alert) override
-  {
-    // ignore close notifications
-    if (alert.type() != Botan::TLS::Alert::CLOSE_NOTIFY)
-    {
-      TLS_PRINT("Got a %s alert: %s\n",
-            (alert.is_fatal() ? "fatal" : "warning"),
-            alert.type_string().c_str());
-    }
-  }
+  // the stream has gone idle, see TLS_SMP_engine::release_buffers()
+  void release_buffers();
 
-  bool tls_session_established(const Botan::TLS::Session&) override
-  {
-    // return true to store session
-    return true;
-  }
+protected:
+  void tls_emit(const uint8_t buf[], size_t len) override;
 
-  void tls_emit_data(const uint8_t buf[], size_t len) override;
+  void tls_record(const uint8_t buf[], size_t len) override;
 
-  void tls_record_received(uint64_t, const uint8_t buf[], size_t len) override;
+  void tls_activated(bool resumed) override;
 
-  void tls_session_activated() override;
+  void tls_closed() override;
 
 private:
+  // hand everything the engine produced during one call to the TCP CPU
+  void flush();
+
   SMP_client& stream;
   Stream::ReadCallback    o_read    = nullptr;
   Stream::ConnectCallback o_connect = nullptr;
 
-  Botan::Credentials_Manager&   m_creds;
-  Botan::TLS::Strict_Policy     m_policy;
-  Botan::TLS::Session_Manager_Noop m_session_manager;
-
-  Botan::TLS::Server m_tls;
-  int  system_cpu = -1;
-  int  stream_id;
-  bool active = false;
+  std::unique_ptr<TLS_SMP_engine> m_engine;
+  // ciphertext and plaintext gathered while inside the engine,
+  // so each call costs at most one buffer per direction
+  tcp::buffer_t m_emit = nullptr;
+  tcp::buffer_t m_recv = nullptr;
+  int     stream_id;
+  int16_t system_cpu = -1;
+  bool    active = false;
+  // the peer sent close_notify, and whether close() has run
+  bool    peer_closed = false;
+  bool    closed = false;
 };
 
-class SMP_client : public tcp::Stream
+/**
+ * TCP stream whose TLS state lives on another CPU (@system_cpu).
+ * The TCP connection stays on the CPU that created it (@tcp_cpu), which
+ * is the BSP for a regular TCP stack. When both are the same CPU, as with
+ * the per-CPU stacks from tcp_smp.cpp, everything runs without a hop.
+**/
+class SMP_client : public tcp::Stream, public Gather_stream
 {
 public:
   using Connection_ptr = tcp::Connection_ptr;
   using State_ptr = std::unique_ptr<SMP_TLS_State>;
 
   SMP_client(Connection_ptr remote, int cpu)
-    : tcp::Stream{remote}, system_cpu(cpu)
+    : tcp::Stream{remote}, system_cpu(cpu), tcp_cpu(SMP::cpu_id())
   {
     assert(tcp->is_connected());
+    auto& load = tls_smp_get_load(system_cpu);
+    load.sessions++;
+    load.handshakes++;
     // default read callback
-    tcp->on_read(4096, {this, &SMP_client::bsp_read});
+    tcp->on_read(m_read_size, {this, &SMP_client::bsp_read});
+    this->track_idle();
+  }
+
+  ~SMP_client()
+  {
+    // the move finishes without us, the state goes with it
+    if (m_migration != nullptr) {
+      m_migration->client = nullptr;
+      m_migration->orphan = std::move(tls_state);
+    }
+    if (m_close_timer != Timers::UNUSED_ID) Timers::stop(m_close_timer);
+    if (this->flush_queued) this->unschedule_flush();
+    if (this->m_waking) this->unschedule_wake();
+    if (m_idle_slot != NO_IDLE_SLOT) this->untrack_idle();
+    auto& load = tls_smp_get_load(system_cpu);
+    load.sessions--;
+    this->handshake_finished();
   }
 
   int get_id() const noexcept {
     if (tls_state) return tls_state->get_id();
     return -1;
   }
+  bool is_affine() const noexcept {
+    return system_cpu == tcp_cpu;
+  }
 
   void assign_tls(State_ptr state)
   {
     this->tls_state = std::move(state);
   }
 
+  /**
+   * Move the TLS state to the least loaded of @cpus once the handshake
+   * is done. Must outlive the stream.
+   */
+  void migrate_after_handshake(const std::vector<int>* cpus)
+  {
+    assert(not is_affine());
+    this->data_cpus = cpus;
+  }
+
   void on_read(size_t bs, ReadCallback cb) override
   {
-    assert(SMP::cpu_id() == 0);
+    assert(SMP::cpu_id() == this->tcp_cpu);
+    this->m_read_size = bs;
+    this->m_idle = false;
     tcp->on_read(bs, {this, &SMP_client::bsp_read});
     // probably safe:
-    SMP::add_task(
-    SMP::task_func::make_packed(
+    run_on_tls(
     [this, cb] () {
       assert(tls_state != nullptr);
       tls_state->on_read(cb);
-    }), this->system_cpu);
-    SMP::signal(this->system_cpu);
+    });
   }
+  /**
+   * @cb is called when the send queue has drained below the low
+   * watermark, after it reached the high watermark.
+   */
   void on_write(WriteCallback cb) override
   {
-    Stream::on_write(cb);
+    assert(SMP::cpu_id() == this->tcp_cpu);
+    this->o_write = cb;
+    tcp->on_write({this, &SMP_client::bsp_written});
+  }
+
+  static const uint32_t DEFAULT_HIGH_WATERMARK = 256 * 1024;
+  static const uint32_t DEFAULT_LOW_WATERMARK  = 64 * 1024;
+
+  /**
+   * Limits for everything written but not yet acknowledged: coalesced
+   * plaintext, data on its way to or from the TLS CPU, and the TCP
+   * send queue. Above @high the stream is not writable.
+   */
+  void set_watermarks(size_t high, size_t low)
+  {
+    assert(low <= high);
+    this->high_watermark = high;
+    this->low_watermark  = low;
+  }
+
+  /** Bytes written that the peer has not yet acknowledged */
+  size_t send_queued() const noexcept
+  {
+    return batched()
+         + m_in_transit.load(std::memory_order_relaxed)
+         + tcp->sendq_remaining();
+  }
+
+  bool is_writable() const noexcept override
+  {
+    return tcp->is_writable() && send_queued() < high_watermark;
   }
   void on_connect(ConnectCallback cb) override
   {
-    assert(SMP::cpu_id() == 0);
-    SMP::add_task(
-    SMP::task_func::make_packed(
+    assert(SMP::cpu_id() == this->tcp_cpu);
+    run_on_tls(
     [this, cb] () {
       assert(tls_state != nullptr);
       this->tls_state->on_connect(cb);
-    }), this->system_cpu);
-    SMP::signal(this->system_cpu);
+    });
   }
   void on_close(CloseCallback cb) override
   {
@@ -179,8 +247,25 @@ public:
 
   void write(const void* buffer, size_t len) override
   {
+    if (len < tls_smp_get_coalescing().max_bytes) {
+      this->coalesce(buffer, len);
+      return;
+    }
+    // keep the order of what was written before
+    this->flush_writes();
+    // TLS is here, so encrypt straight from the callers memory
+    if (is_affine()) {
+      assert(tls_state != nullptr);
+      tls_state->write((const uint8_t*) buffer, len);
+      this->check_watermarks();
+      return;
+    }
     // create buffer we have control over
-    write(tcp::construct_buffer((char*) buffer, (char*) buffer + len));
+    auto& stats = tls_smp_get_stats(SMP::cpu_id());
+    stats.buffers_allocated++;
+    stats.bytes_copied += len;
+    send_plaintext(buffer_pool::copy(buffer, len));
+    this->check_watermarks();
   }
   void write(const std::string& str) override
   {
@@ -190,52 +275,333 @@ public:
   {
     TLS_PRINT("TCP %d write(buffer_t) called on %d\n",
               get_id(), SMP::cpu_id());
-    assert(tls_state != nullptr);
-    assert(tls_state->is_active());
-
-    SMP::add_task(
-    [this, buff = std::move(buf)] () {
-      tls_state->write(std::move(buff));
-    }, this->system_cpu);
-    SMP::signal(this->system_cpu);
+    // batched by reference, like TCP queues it
+    if (buf->size() < tls_smp_get_coalescing().max_bytes) {
+      this->writev(&buf, 1);
+      return;
+    }
+    this->flush_writes();
+    send_plaintext(std::move(buf));
+  }
+  /**
+   * The buffers are batched by reference, never copied, and encrypted
+   * together with whatever else is batched. Nothing may change them
+   * until they are encrypted.
+   */
+  void writev(const buffer_t* bufs, size_t count) override;
+
+  void close() override
+  {
+    this->flush_writes();
+    // ciphertext still on its way from the TLS CPU goes out first
+    if (m_in_transit.load() > 0) {
+      this->close_pending = true;
+      return;
+    }
+    Stream::close();
   }
 
+  /** Encrypt and send everything coalesced so far */
+  void flush_writes();
+
+  /**
+   * Close once @delay has passed, see TLS_SMP_engine::close_delay().
+   * What arrives meanwhile is ignored.
+   */
+  void close_later(std::chrono::milliseconds delay);
+
   std::string to_string() const override {
     return tcp->to_string();
   }
 
   void reset_callbacks() override
   {
+    o_write = nullptr;
     tcp->reset_callbacks();
     if (tls_state) tls_state->reset();
   }
 
 protected:
+  /**
+   * A state on its way to another CPU. Tasks for it are parked in
+   * inline cells, like SMP_queue's, and keep their own type so they are
+   * queued inline again when released. Tasks that don't fit, and
+   * everything after them, go to an overflow list. Should the stream go
+   * away first, its state stays here until the fence is back.
+   */
+  struct migration_t
+  {
+    static const int CELLS = 8;
+
+    explicit migration_t(SMP_client* c) : client(c) {}
+    ~migration_t() { release(-1); }
+
+    template <typename Func>
+    void park(Func&& func)
+    {
+      using F = typename std::decay<Func>::type;
+      if (alignof(F) <= 16 && overflow.empty() && count < CELLS
+          && try_park(std::forward<Func>(func)))
+          return;
+      overflow.push_back(SMP::task_func::make_packed(std::forward<Func>(func)));
+    }
+
+    // send every parked task to @cpu in order, or drop them all with -1
+    void release(int cpu)
+    {
+      for (int i = 0; i < count; i++)
+          cells[i].send(cells[i].storage, cpu);
+      count = 0;
+      if (cpu >= 0)
+        for (auto& func : overflow) tls_smp_run(cpu, std::move(func));
+      overflow.clear();
+    }
+
+    template <typename Func>
+    typename std::enable_if<(sizeof(typename std::decay<Func>::type) <= SMP_queue::TASK_SIZE), bool>::type
+    try_park(Func&& func)
+    {
+      using F = typename std::decay<Func>::type;
+      auto& cell = cells[count++];
+      new (cell.storage) F(std::forward<Func>(func));
+      cell.send = &send_task<F>;
+      return true;
+    }
+
+    template <typename Func>
+    typename std::enable_if<(sizeof(typename std::decay<Func>::type) > SMP_queue::TASK_SIZE), bool>::type
+    try_park(Func&&) {
+      return false;
+    }
+
+    template <typename F>
+    static void send_task(void* ptr, int cpu)
+    {
+      auto* func = static_cast<F*>(ptr);
+      if (cpu >= 0) tls_smp_run(cpu, std::move(*func));
+      func->~F();
+    }
+
+    struct cell_t
+    {
+      void (*send)(void*, int);
+      alignas(16) char storage[SMP_queue::TASK_SIZE];
+    };
+
+    SMP_client* client;
+    State_ptr orphan = nullptr;
+    int count = 0;
+    cell_t cells[CELLS];
+    std::vector<SMP::task_func> overflow;
+  };
+
+  void send_plaintext(buffer_t buf)
+  {
+    assert(tls_state != nullptr);
+    assert(tls_state->is_active());
+
+    const int64_t len = buf->size();
+    const int cpu = this->system_cpu;
+    if (not is_affine())
+        tls_smp_get_load(cpu).queued_bytes += len;
+    m_in_transit += len;
+    run_on_tls(
+    [this, buff = std::move(buf), len, cpu] () {
+      tls_state->write(std::move(buff));
+      this->plaintext_done(len);
+      if (cpu != tcp_cpu)
+          tls_smp_get_load(cpu).queued_bytes -= len;
+    });
+    this->check_watermarks();
+  }
+  // remember to tell the writer when the queue has drained
+  void check_watermarks()
+  {
+    if (send_queued() >= high_watermark) this->write_blocked = true;
+  }
+  void bsp_written(size_t n)
+  {
+    if (this->write_blocked && send_queued() <= low_watermark)
+    {
+      this->write_blocked = false;
+      if (o_write) o_write(n);
+    }
+  }
+  // add a small write to the current batch
+  void coalesce(const void* data, size_t len);
+  // plaintext waiting in the batch
+  size_t batched() const noexcept {
+    return (m_batch ? m_batch->size() : 0) + m_segment_bytes;
+  }
+  void send_segments(std::vector<buffer_t> segs, int64_t len);
+  void schedule_flush();
+  static void flush_all();
+  void unschedule_flush();
+  // the idle sweep, see tls_smp_idle
+  void track_idle();
+  void untrack_idle();
+  void idle_tick();
+  static void idle_sweep();
+  // an idle stream has traffic: grow the TCP read size back, later
+  void wake();
+  void unschedule_wake();
+  static void wake_all();
+
   void bsp_write(buffer_t buf)
   {
     TLS_PRINT("TCP %d bsp_write(): %lu bytes on %d\n",
               get_id(), buf->size(), SMP::cpu_id());
-    assert(SMP::cpu_id() == 0);
+    assert(SMP::cpu_id() == this->tcp_cpu);
+    this->m_quiet = 0;
+    m_in_transit -= buf->size();
+    // the connection went away while we were encrypting: without this
+    // record nothing after it decrypts, so no more is sent at all
+    if (not tcp->is_writable()) {
+      this->close_pending = false;
+      if (not tcp->is_closing() && not tcp->is_closed()) Stream::close();
+      return;
+    }
     Stream::write(std::move(buf));
+    if (this->close_if_drained()) return;
+    this->bsp_written(0);
+  }
+  // carry out a pending close once nothing is in transit, on the TCP CPU
+  bool close_if_drained()
+  {
+    if (not this->close_pending || m_in_transit.load() != 0) return false;
+    this->close_pending = false;
+    Stream::close();
+    return true;
+  }
+  /**
+   * On the TLS CPU, once @len bytes of plaintext are encrypted. Their
+   * ciphertext is accounted for by now, so reaching zero here means no
+   * bsp_write follows, as when the engine failed, to do a pending close.
+   */
+  void plaintext_done(int64_t len)
+  {
+    if ((m_in_transit -= len) == 0)
+      tls_smp_post(this->tcp_cpu,
+      [this] () {
+        this->close_if_drained();
+      });
   }
   void bsp_read(buffer_t buf)
   {
     TLS_PRINT("TCP %d bsp_read(): %lu bytes on %d\n",
               get_id(), buf->size(), SMP::cpu_id());
-    assert(SMP::cpu_id() == 0);
+    assert(SMP::cpu_id() == this->tcp_cpu);
+    if (m_close_timer != Timers::UNUSED_ID) return;
+    this->m_quiet = 0;
+    // traffic again: the read size grows back right after this callback
+    if (this->m_idle) this->wake();
 
     // execute tls_read on selected vcpu
-    SMP::add_task(
-    [this, buff = std::move(buf)] () {
+    const int cpu = this->system_cpu;
+    if (not is_affine())
+        tls_smp_get_load(cpu).queued_bytes += buf->size();
+    run_on_tls(
+    [this, buff = std::move(buf), cpu] () {
       assert(tls_state);
-      this->tls_state->read(std::move(buff));
-    }, this->system_cpu);
-    SMP::signal(this->system_cpu);
+      this->tls_state->read(buff);
+      if (cpu != tcp_cpu)
+          tls_smp_get_load(cpu).queued_bytes -= buff->size();
+    });
+  }
+
+  // run @func where the TLS state lives, or hold it while the state moves
+  template <typename Func>
+  void run_on_tls(Func&& func)
+  {
+    if (m_migration != nullptr) {
+      m_migration->park(std::forward<Func>(func));
+      return;
+    }
+    tls_smp_run(this->system_cpu, std::forward<Func>(func));
+  }
+
+  /**
+   * Runs on the TCP CPU, told by the state that its handshake is done.
+   * Tasks for the state are parked from here on. The old CPU gets a
+   * fence behind everything it was already sent, and only when the
+   * fence has run is the state handed over and the parked tasks sent
+   * to the new CPU. That keeps every task in order without locks.
+   * The fence holds the migration record, never the stream, which
+   * may be deleted before the fence is back.
+   */
+  void migrate()
+  {
+    assert(SMP::cpu_id() == this->tcp_cpu);
+    const int cpu = tls_smp_select_cpu(*data_cpus);
+    if (cpu == this->system_cpu) return;
+
+    auto* m = new migration_t(this);
+    this->m_migration = m;
+    const int tcp = this->tcp_cpu;
+    tls_smp_run(this->system_cpu,
+    [m, state = tls_state.get(), cpu, tcp] () {
+      state->move_to(cpu);
+      tls_smp_run(tcp,
+      [m, cpu] () {
+        SMP_client::migrated(m, cpu);
+      });
+    });
+  }
+
+  // the fence is back on the TCP CPU, see migrate()
+  static void migrated(migration_t* m, int cpu)
+  {
+    std::unique_ptr<migration_t> done(m);
+    auto* client = m->client;
+    if (client == nullptr) return;
+    auto& old_load = tls_smp_get_load(client->system_cpu);
+    old_load.sessions--;
+    tls_smp_get_load(cpu).sessions++;
+    client->system_cpu  = cpu;
+    client->m_migration = nullptr;
+    m->release(cpu);
+  }
+
+  // the handshake completed or the stream is gone, counted once
+  void handshake_finished()
+  {
+    if (not handshake_done.exchange(true))
+        tls_smp_get_load(system_cpu).handshakes--;
   }
 
 private:
+  // ordered by size, this is kept for every connection
   State_ptr tls_state = nullptr;
+  // handshake CPU to data CPU hand-over, only touched on the TCP CPU
+  const std::vector<int>* data_cpus = nullptr;
+  // only while the state moves, see migrate()
+  migration_t* m_migration = nullptr;
+  // small writes waiting to be encrypted as one, on the TCP CPU:
+  // gathered buffers, followed by copies of other writes in m_batch
+  std::vector<buffer_t> m_segments;
+  size_t   m_segment_bytes = 0;
+  buffer_t m_batch = nullptr;
+  WriteCallback o_write = nullptr;
+  // plaintext handed to the TLS CPU and ciphertext on its way back
+  std::atomic<int64_t> m_in_transit {0};
   int  system_cpu = -1;
+  int  tcp_cpu    = -1;
+  Timers::id_t m_close_timer = Timers::UNUSED_ID;
+  // backpressure, see set_watermarks()
+  uint32_t high_watermark = DEFAULT_HIGH_WATERMARK;
+  uint32_t low_watermark  = DEFAULT_LOW_WATERMARK;
+  // the TCP read size while busy, our place in the idle sweep, and
+  // the sweeps since there was traffic
+  static const uint32_t NO_IDLE_SLOT = UINT32_MAX;
+  uint32_t m_read_size = 4096;
+  uint32_t m_idle_slot = NO_IDLE_SLOT;
+  uint8_t  m_quiet = 0;
+  bool m_idle = false;
+  bool m_waking = false;
+  std::atomic<bool> handshake_done {false};
+  bool flush_queued = false;
+  bool write_blocked = false;
+  bool close_pending = false;
   friend class SMP_TLS_State;
 };
 
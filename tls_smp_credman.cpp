@@ -0,0 +1,91 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2016-2017 Oslo and Akershus University College of Applied Sciences
+// and Alfred Bratterud
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tls_smp_credman.hpp"
+#include "tls_smp_system.hpp"
+#include <rtc>
+
+Session_ticket_keys& Session_ticket_keys::get()
+{
+  static Session_ticket_keys keys;
+  return keys;
+}
+
+Botan::SymmetricKey Session_ticket_keys::current()
+{
+  const int64_t now = RTC::now();
+  lock(lock_);
+  if (key_.length() == 0 || now - created_ >= interval_)
+  {
+    key_ = Botan::SymmetricKey(tls_smp_system::get_rng(), 32);
+    created_ = now;
+    rotations_++;
+  }
+  auto key = key_;
+  unlock(lock_);
+  return key;
+}
+
+void Session_ticket_keys::set_rotation(std::chrono::seconds interval)
+{
+  lock(lock_);
+  interval_ = interval.count();
+  unlock(lock_);
+}
+
+void TLS_SMP_credman::add_certificate(
+      std::vector<Botan::X509_Certificate> chain,
+      std::unique_ptr<Botan::Private_Key> key)
+{
+  assert(not chain.empty() && key != nullptr);
+  profiles.push_back({std::move(chain), std::move(key)});
+}
+
+std::vector<Botan::X509_Certificate>
+TLS_SMP_credman::cert_chain(const std::vector<std::string>& cert_key_types,
+                            const std::string& type,
+                            const std::string& context)
+{
+  for (const auto& key_type : cert_key_types)
+  {
+    for (const auto& profile : profiles)
+      if (profile.key->algo_name() == key_type) return profile.chain;
+
+    auto chain = inner->cert_chain({key_type}, type, context);
+    if (not chain.empty()) return chain;
+  }
+  return {};
+}
+
+Botan::Private_Key*
+TLS_SMP_credman::private_key_for(const Botan::X509_Certificate& cert,
+                                 const std::string& type,
+                                 const std::string& context)
+{
+  for (const auto& profile : profiles)
+    if (profile.chain.front() == cert) return profile.key.get();
+  return inner->private_key_for(cert, type, context);
+}
+
+Botan::SymmetricKey TLS_SMP_credman::psk(const std::string& type,
+                                         const std::string& context,
+                                         const std::string& identity)
+{
+  if (type == "tls-server" && context == "session-ticket")
+      return Session_ticket_keys::get().current();
+  return inner->psk(type, context, identity);
+}
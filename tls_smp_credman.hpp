@@ -0,0 +1,104 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2016-2017 Oslo and Akershus University College of Applied Sciences
+// and Alfred Bratterud
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#ifndef TLS_SMP_CREDMAN_HPP
+#define TLS_SMP_CREDMAN_HPP
+
+#include <botan/credentials_manager.h>
+#include <botan/pk_keys.h>
+#include <botan/symkey.h>
+#include <botan/x509cert.h>
+#include <chrono>
+#include <memory>
+#include <smp>
+
+/**
+ * @brief      Session ticket encryption key shared by every worker CPU,
+ *             so that a ticket issued on one CPU can be resumed on any
+ *             other. The key is replaced after each rotation interval;
+ *             tickets issued under the previous key fall back to a full
+ *             handshake (or to the session ID cache).
+ */
+class Session_ticket_keys
+{
+public:
+  static Session_ticket_keys& get();
+
+  Botan::SymmetricKey current();
+
+  void set_rotation(std::chrono::seconds interval);
+
+  uint64_t rotations() const noexcept { return rotations_; }
+
+private:
+  spinlock_t lock_ = 0;
+  Botan::SymmetricKey key_;
+  int64_t  created_ = 0;
+  int64_t  interval_ = 3600;
+  uint64_t rotations_ = 0;
+};
+
+/**
+ * @brief      Credentials manager used by the TLS SMP streams.
+ *             Holds any number of extra certificate/key pairs (eg. ECDSA
+ *             next to RSA) and picks the first one whose key type the
+ *             client accepts, in the order Botan asks for them; otherwise
+ *             forwards to the loaded credentials. Also hands out the
+ *             shared session ticket key.
+ */
+class TLS_SMP_credman : public Botan::Credentials_Manager
+{
+public:
+  explicit TLS_SMP_credman(std::unique_ptr<Botan::Credentials_Manager> creds)
+    : inner(std::move(creds)) {}
+
+  /**
+   * @brief      Add a certificate chain and the private key of its leaf.
+   */
+  void add_certificate(std::vector<Botan::X509_Certificate> chain,
+                       std::unique_ptr<Botan::Private_Key> key);
+
+  std::vector<Botan::Certificate_Store*>
+  trusted_certificate_authorities(const std::string& type,
+                                  const std::string& context) override
+  { return inner->trusted_certificate_authorities(type, context); }
+
+  std::vector<Botan::X509_Certificate>
+  cert_chain(const std::vector<std::string>& cert_key_types,
+             const std::string& type,
+             const std::string& context) override;
+
+  Botan::Private_Key*
+  private_key_for(const Botan::X509_Certificate& cert,
+                  const std::string& type,
+                  const std::string& context) override;
+
+  Botan::SymmetricKey psk(const std::string& type,
+                          const std::string& context,
+                          const std::string& identity) override;
+
+private:
+  struct profile_t {
+    std::vector<Botan::X509_Certificate> chain;
+    std::unique_ptr<Botan::Private_Key>  key;
+  };
+  std::unique_ptr<Botan::Credentials_Manager> inner;
+  std::vector<profile_t> profiles;
+};
+
+#endif
@@ -0,0 +1,117 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2017 Oslo and Akershus University College of Applied Sciences
+// and Alfred Bratterud
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#ifndef TLS_SMP_ENGINE_HPP
+#define TLS_SMP_ENGINE_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <sys/uio.h>
+
+namespace Botan {
+  class Credentials_Manager;
+  class RandomNumberGenerator;
+}
+
+/**
+ * @brief      The server side of one TLS connection, as seen by the SMP
+ *             streams. It is fed ciphertext and plaintext on the worker
+ *             CPU that owns the connection, and reports what it produces
+ *             through Output while being called. Fatal errors are thrown
+ *             as exceptions derived from std::exception.
+ *
+ *             An engine may be moved to another CPU between calls.
+ */
+class TLS_SMP_engine
+{
+public:
+  struct Output
+  {
+    // ciphertext for the peer
+    virtual void tls_emit(const uint8_t* data, size_t len) = 0;
+    // plaintext from the peer
+    virtual void tls_record(const uint8_t* data, size_t len) = 0;
+    // the handshake has completed, @resumed when it resumed a session
+    virtual void tls_activated(bool resumed) = 0;
+    // the peer sent close_notify
+    virtual void tls_closed() = 0;
+    virtual ~Output() = default;
+  };
+
+  /** Process ciphertext received from the peer */
+  virtual void received(const uint8_t* data, size_t len) = 0;
+
+  /** Encrypt plaintext for the peer */
+  virtual void send(const uint8_t* data, size_t len) = 0;
+
+  /**
+   * Encrypt plaintext given in pieces, as if it were one buffer.
+   * Records are encrypted from contiguous memory, so by default small
+   * pieces are joined in a per-CPU record buffer, while pieces of a
+   * record or more go straight to send(). Engines that gather override it.
+   */
+  virtual void sendv(const iovec* iov, size_t count);
+
+  /** Send close_notify */
+  virtual void close() = 0;
+
+  /**
+   * After a fatal error: how long the connection must stay open before
+   * it is closed, so that the peer cannot time the error. None by default.
+   */
+  virtual std::chrono::milliseconds close_delay() const noexcept { return {}; }
+
+  /**
+   * The connection has gone quiet: free what is only needed while
+   * records are moving, like record and I/O buffers. The engine
+   * allocates them again when it is next called. By default, nothing.
+   */
+  virtual void release_buffers() {}
+
+  virtual const char* name() const noexcept = 0;
+
+  virtual ~TLS_SMP_engine() = default;
+};
+
+/**
+ * Creates the engine for a new connection. Each worker CPU has its own
+ * factory, holding that CPU's configuration and credentials.
+**/
+using tls_smp_engine_factory =
+    std::function<std::unique_ptr<TLS_SMP_engine>(TLS_SMP_engine::Output&)>;
+
+/** Botan, with the shared session cache and TLS_SMP_policy */
+tls_smp_engine_factory tls_smp_botan_engines(
+    Botan::RandomNumberGenerator& rng,
+    Botan::Credentials_Manager&   credman);
+
+/** s2n, from a PEM certificate chain and PEM private key */
+tls_smp_engine_factory tls_smp_s2n_engines(
+    const std::string& cert_chain_pem,
+    const std::string& key_pem);
+
+/** OpenSSL with memory BIOs, from a PEM certificate and PEM private key */
+tls_smp_engine_factory tls_smp_openssl_engines(
+    const std::string& cert_pem,
+    const std::string& key_pem);
+
+#endif
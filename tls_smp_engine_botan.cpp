@@ -0,0 +1,143 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2017 Oslo and Akershus University College of Applied Sciences
+// and Alfred Bratterud
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tls_smp_engine.hpp"
+#include "tls_smp_system.hpp"
+#include "tls_session_cache.hpp"
+#include "tls_smp_policy.hpp"
+#include <botan/tls_server.h>
+#include <botan/tls_callbacks.h>
+
+/**
+ * The credentials of one connection, forwarded to the CPU's credentials
+ * manager. A resumed session never needs the server's private key, so
+ * being asked for it is what marks a full handshake.
+**/
+class Handshake_credman : public Botan::Credentials_Manager
+{
+public:
+  explicit Handshake_credman(Botan::Credentials_Manager& creds)
+    : m_creds(creds) {}
+
+  std::vector<Botan::Certificate_Store*>
+  trusted_certificate_authorities(const std::string& type,
+                                  const std::string& context) override
+  { return m_creds.trusted_certificate_authorities(type, context); }
+
+  std::vector<Botan::X509_Certificate>
+  cert_chain(const std::vector<std::string>& cert_key_types,
+             const std::string& type,
+             const std::string& context) override
+  { return m_creds.cert_chain(cert_key_types, type, context); }
+
+  Botan::Private_Key*
+  private_key_for(const Botan::X509_Certificate& cert,
+                  const std::string& type,
+                  const std::string& context) override
+  {
+    this->full = true;
+    return m_creds.private_key_for(cert, type, context);
+  }
+
+  Botan::SymmetricKey psk(const std::string& type,
+                          const std::string& context,
+                          const std::string& identity) override
+  { return m_creds.psk(type, context, identity); }
+
+  bool full = false;
+private:
+  Botan::Credentials_Manager& m_creds;
+};
+
+class Botan_SMP_engine : public TLS_SMP_engine,
+                         public Botan::TLS::Callbacks
+{
+public:
+  Botan_SMP_engine(Output& output,
+                   Botan::RandomNumberGenerator& rng,
+                   Botan::Credentials_Manager&   credman)
+    : out(output),
+      m_creds(credman),
+      m_tls(*this, TLS_session_cache::get(), m_creds, m_policy, rng)
+  {}
+
+  void received(const uint8_t* data, size_t len) override
+  {
+    m_tls.received_data(data, len);
+  }
+  void send(const uint8_t* data, size_t len) override
+  {
+    m_tls.send(data, len);
+  }
+  void close() override
+  {
+    m_tls.close();
+  }
+  const char* name() const noexcept override { return "Botan"; }
+
+protected:
+  void tls_alert(Botan::TLS::Alert alert) override
+  {
+    if (alert.type() == Botan::TLS::Alert::CLOSE_NOTIFY) {
+      out.tls_closed();
+    }
+    else
+    {
+      TLS_PRINT("Got a %s alert: %s\n",
+            (alert.is_fatal() ? "fatal" : "warning"),
+            alert.type_string().c_str());
+    }
+  }
+
+  bool tls_session_established(const Botan::TLS::Session&) override
+  {
+    // called for resumed sessions too, see Handshake_credman
+    // return true to store session
+    return true;
+  }
+
+  void tls_emit_data(const uint8_t buf[], size_t len) override
+  {
+    out.tls_emit(buf, len);
+  }
+
+  void tls_record_received(uint64_t, const uint8_t buf[], size_t len) override
+  {
+    out.tls_record(buf, len);
+  }
+
+  void tls_session_activated() override
+  {
+    out.tls_activated(not m_creds.full);
+  }
+
+private:
+  Output&        out;
+  TLS_SMP_policy m_policy;
+  Handshake_credman  m_creds;
+  Botan::TLS::Server m_tls;
+};
+
+tls_smp_engine_factory tls_smp_botan_engines(
+    Botan::RandomNumberGenerator& rng,
+    Botan::Credentials_Manager&   credman)
+{
+  return [&rng, &credman] (TLS_SMP_engine::Output& out) {
+    return std::unique_ptr<TLS_SMP_engine>(
+        new Botan_SMP_engine(out, rng, credman));
+  };
+}
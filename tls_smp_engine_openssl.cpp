@@ -0,0 +1,189 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2017 Oslo and Akershus University College of Applied Sciences
+// and Alfred Bratterud
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tls_smp_engine.hpp"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <array>
+#include <stdexcept>
+#include <smp>
+
+// ciphertext and decrypted records pass through here
+static SMP_ARRAY<std::array<uint8_t, 16384>> openssl_scratch;
+
+static std::runtime_error openssl_error(const char* what)
+{
+  char reason[256];
+  ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+  // the queue is per thread, so whatever is left would fail the next
+  // connection on this CPU
+  ERR_clear_error();
+  return std::runtime_error(std::string(what) + ": " + reason);
+}
+
+/**
+ * OpenSSL between two memory BIOs: ciphertext from the peer is written
+ * into one, and what OpenSSL writes to the other is drained to Output
+ * after every call.
+**/
+class OpenSSL_SMP_engine : public TLS_SMP_engine
+{
+public:
+  OpenSSL_SMP_engine(Output& output, std::shared_ptr<SSL_CTX> context)
+    : out(output), ctx(std::move(context))
+  {
+    ssl = SSL_new(ctx.get());
+    if (ssl == nullptr) throw openssl_error("SSL_new");
+    rbio = BIO_new(BIO_s_mem());
+    wbio = BIO_new(BIO_s_mem());
+    // the SSL object owns both BIOs from here on
+    SSL_set_bio(ssl, rbio, wbio);
+    SSL_set_accept_state(ssl);
+  }
+  ~OpenSSL_SMP_engine()
+  {
+    SSL_free(ssl);
+  }
+
+  void received(const uint8_t* data, size_t len) override
+  {
+    if (BIO_write(rbio, data, len) != (int) len)
+        throw openssl_error("BIO_write");
+
+    if (not active)
+    {
+      // SSL_get_error() looks at the error queue, which must start empty
+      ERR_clear_error();
+      const int res = SSL_do_handshake(ssl);
+      if (res != 1) {
+        check(res, "SSL_do_handshake");
+        drain();
+        return;
+      }
+      active = true;
+      drain();
+      out.tls_activated(SSL_session_reused(ssl));
+    }
+
+    auto& buffer = PER_CPU(openssl_scratch);
+    while (true)
+    {
+      ERR_clear_error();
+      const int n = SSL_read(ssl, buffer.data(), buffer.size());
+      if (n <= 0) {
+        check(n, "SSL_read");
+        break;
+      }
+      out.tls_record(buffer.data(), n);
+    }
+    // alerts, renegotiation and so on
+    drain();
+  }
+
+  void send(const uint8_t* data, size_t len) override
+  {
+    // memory BIOs accept everything, so writes complete in one go
+    ERR_clear_error();
+    const int res = SSL_write(ssl, data, len);
+    if (res <= 0) check(res, "SSL_write");
+    drain();
+  }
+
+  void close() override
+  {
+    ERR_clear_error();
+    SSL_shutdown(ssl);
+    drain();
+  }
+
+  void release_buffers() override
+  {
+    // fails, harmlessly, while a record is partly read or written
+    (void) SSL_free_buffers(ssl);
+    // drained memory BIOs keep the largest size they ever had
+    if (BIO_ctrl_pending(rbio) == 0 && BIO_ctrl_pending(wbio) == 0)
+    {
+      rbio = BIO_new(BIO_s_mem());
+      wbio = BIO_new(BIO_s_mem());
+      // frees the old pair
+      SSL_set_bio(ssl, rbio, wbio);
+    }
+  }
+
+  const char* name() const noexcept override { return "OpenSSL"; }
+
+private:
+  void check(int res, const char* what)
+  {
+    switch (SSL_get_error(ssl, res)) {
+    case SSL_ERROR_NONE:
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      return;
+    case SSL_ERROR_ZERO_RETURN:
+      out.tls_closed();
+      return;
+    default:
+      throw openssl_error(what);
+    }
+  }
+  void drain()
+  {
+    auto& buffer = PER_CPU(openssl_scratch);
+    int n;
+    while ((n = BIO_read(wbio, buffer.data(), buffer.size())) > 0)
+        out.tls_emit(buffer.data(), n);
+  }
+
+  Output& out;
+  std::shared_ptr<SSL_CTX> ctx;
+  SSL* ssl  = nullptr;
+  BIO* rbio = nullptr;
+  BIO* wbio = nullptr;
+  bool active = false;
+};
+
+tls_smp_engine_factory tls_smp_openssl_engines(
+    const std::string& cert_pem,
+    const std::string& key_pem)
+{
+  std::shared_ptr<SSL_CTX> ctx(SSL_CTX_new(TLS_server_method()), SSL_CTX_free);
+  if (ctx == nullptr) throw openssl_error("SSL_CTX_new");
+  SSL_CTX_set_min_proto_version(ctx.get(), TLS1_2_VERSION);
+
+  BIO* bio = BIO_new_mem_buf(cert_pem.data(), cert_pem.size());
+  X509* cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+  if (cert == nullptr) throw openssl_error("PEM_read_bio_X509");
+  const int cert_ok = SSL_CTX_use_certificate(ctx.get(), cert);
+  X509_free(cert);
+  if (cert_ok != 1) throw openssl_error("SSL_CTX_use_certificate");
+
+  bio = BIO_new_mem_buf(key_pem.data(), key_pem.size());
+  EVP_PKEY* key = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+  if (key == nullptr) throw openssl_error("PEM_read_bio_PrivateKey");
+  const int key_ok = SSL_CTX_use_PrivateKey(ctx.get(), key);
+  EVP_PKEY_free(key);
+  if (key_ok != 1 || SSL_CTX_check_private_key(ctx.get()) != 1)
+      throw openssl_error("SSL_CTX_use_PrivateKey");
+
+  return [ctx] (TLS_SMP_engine::Output& out) {
+    return std::unique_ptr<TLS_SMP_engine>(new OpenSSL_SMP_engine(out, ctx));
+  };
+}
@@ -0,0 +1,209 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2017 Oslo and Akershus University College of Applied Sciences
+// and Alfred Bratterud
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tls_smp_engine.hpp"
+#include <s2n.h>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <smp>
+
+// decrypted records are handed out from here, not kept per connection
+static SMP_ARRAY<std::array<uint8_t, 16384>> s2n_scratch;
+
+static std::runtime_error s2n_error(const char* what)
+{
+  return std::runtime_error(std::string(what) + ": "
+                            + s2n_strerror(s2n_errno, "EN"));
+}
+
+static bool s2n_is_blocked()
+{
+  return s2n_error_get_type(s2n_errno) == S2N_ERR_T_BLOCKED;
+}
+
+/**
+ * s2n reads and writes through callbacks: received() lends it the
+ * caller's ciphertext until s2n blocks on reading, and everything it
+ * writes is passed straight on to Output.
+**/
+class S2N_SMP_engine : public TLS_SMP_engine
+{
+public:
+  S2N_SMP_engine(Output& output, std::shared_ptr<s2n_config> cfg)
+    : out(output), config(std::move(cfg))
+  {
+    conn = s2n_connection_new(S2N_SERVER);
+    if (conn == nullptr) throw s2n_error("s2n_connection_new");
+    s2n_connection_set_config(conn, config.get());
+    // s2n would otherwise sleep out its blinding delay inside the
+    // call, stalling every connection on this CPU. See close_delay()
+    if (s2n_connection_set_blinding(conn, S2N_SELF_SERVICE_BLINDING) < 0) {
+      s2n_connection_free(conn);
+      throw s2n_error("s2n_connection_set_blinding");
+    }
+    s2n_connection_set_recv_cb(conn, &S2N_SMP_engine::recv_cb);
+    s2n_connection_set_recv_ctx(conn, this);
+    s2n_connection_set_send_cb(conn, &S2N_SMP_engine::send_cb);
+    s2n_connection_set_send_ctx(conn, this);
+  }
+  ~S2N_SMP_engine()
+  {
+    s2n_connection_free(conn);
+  }
+
+  void received(const uint8_t* data, size_t len) override
+  {
+    in_data = data;
+    in_len  = len;
+    s2n_blocked_status blocked;
+
+    if (not active)
+    {
+      if (s2n_negotiate(conn, &blocked) < 0) {
+        if (not s2n_is_blocked()) throw s2n_error("s2n_negotiate");
+        return;
+      }
+      active = true;
+      out.tls_activated(s2n_connection_is_session_resumed(conn) == 1);
+    }
+
+    auto& buffer = PER_CPU(s2n_scratch);
+    while (true)
+    {
+      const ssize_t n = s2n_recv(conn, buffer.data(), buffer.size(), &blocked);
+      if (n > 0) {
+        out.tls_record(buffer.data(), n);
+        continue;
+      }
+      // the peer closed the connection
+      if (n == 0) {
+        out.tls_closed();
+        break;
+      }
+      if (not s2n_is_blocked()) throw s2n_error("s2n_recv");
+      break;
+    }
+  }
+
+  void send(const uint8_t* data, size_t len) override
+  {
+    s2n_blocked_status blocked;
+    // the send callback never blocks, so this only loops on large sends
+    while (len > 0)
+    {
+      const ssize_t n = s2n_send(conn, (void*) data, len, &blocked);
+      if (n < 0) throw s2n_error("s2n_send");
+      data += n;
+      len  -= n;
+    }
+  }
+
+  void sendv(const iovec* iov, size_t count) override
+  {
+    ssize_t total = 0;
+    for (size_t i = 0; i < count; i++) total += iov[i].iov_len;
+    // s2n builds its records from the pieces, nothing is joined here
+    s2n_blocked_status blocked;
+    ssize_t offset = 0;
+    while (offset < total)
+    {
+      const ssize_t n = s2n_sendv_with_offset(conn, iov, count, offset, &blocked);
+      if (n < 0) throw s2n_error("s2n_sendv_with_offset");
+      offset += n;
+    }
+  }
+
+  void close() override
+  {
+    s2n_blocked_status blocked;
+    // sends close_notify, then blocks waiting for the peers
+    s2n_shutdown(conn, &blocked);
+  }
+
+  void release_buffers() override
+  {
+    // fails, harmlessly, while a record is partly read or written
+    s2n_connection_release_buffers(conn);
+  }
+
+  std::chrono::milliseconds close_delay() const noexcept override
+  {
+    const std::chrono::nanoseconds delay(s2n_connection_get_delay(conn));
+    return std::chrono::duration_cast<std::chrono::milliseconds>(delay);
+  }
+
+  const char* name() const noexcept override { return "s2n"; }
+
+private:
+  static int recv_cb(void* ctx, uint8_t* buf, uint32_t len)
+  {
+    auto* self = (S2N_SMP_engine*) ctx;
+    if (self->in_len == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    const size_t n = std::min((size_t) len, self->in_len);
+    std::memcpy(buf, self->in_data, n);
+    self->in_data += n;
+    self->in_len  -= n;
+    return n;
+  }
+  static int send_cb(void* ctx, const uint8_t* buf, uint32_t len)
+  {
+    auto* self = (S2N_SMP_engine*) ctx;
+    self->out.tls_emit(buf, len);
+    return len;
+  }
+
+  Output& out;
+  std::shared_ptr<s2n_config> config;
+  s2n_connection* conn = nullptr;
+  const uint8_t*  in_data = nullptr;
+  size_t          in_len  = 0;
+  bool            active  = false;
+};
+
+tls_smp_engine_factory tls_smp_s2n_engines(
+    const std::string& cert_chain_pem,
+    const std::string& key_pem)
+{
+  // once for all CPUs, whichever gets here first
+  static spinlock_t init_lock = 0;
+  static bool initialized = false;
+  lock(init_lock);
+  if (not initialized) {
+    // may already have been done by the OS S2N server
+    initialized = s2n_init() == 0
+        || std::strcmp(s2n_strerror_name(s2n_errno), "S2N_ERR_INITIALIZED") == 0;
+  }
+  const bool ready = initialized;
+  unlock(init_lock);
+  if (not ready) throw s2n_error("s2n_init");
+
+  std::shared_ptr<s2n_config> config(s2n_config_new(), s2n_config_free);
+  if (config == nullptr) throw s2n_error("s2n_config_new");
+  if (s2n_config_add_cert_chain_and_key(config.get(),
+          cert_chain_pem.c_str(), key_pem.c_str()) < 0)
+      throw s2n_error("s2n_config_add_cert_chain_and_key");
+
+  return [config] (TLS_SMP_engine::Output& out) {
+    return std::unique_ptr<TLS_SMP_engine>(new S2N_SMP_engine(out, config));
+  };
+}
@@ -0,0 +1,65 @@
+// This file is a part of the IncludeOS unikernel - www.includeos.org
+//
+// Copyright 2016-2017 Oslo and Akershus University College of Applied Sciences
+// and Alfred Bratterud
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#ifndef TLS_SMP_POLICY_HPP
+#define TLS_SMP_POLICY_HPP
+
+#include <botan/tls_policy.h>
+
+/**
+ * @brief      TLS policy tuned for cheap handshakes.
+ *             ECDHE over X25519 first, ECDSA signatures before RSA
+ *             (when an ECDSA certificate is loaded), and AES-GCM,
+ *             which runs on AES-NI, as the bulk cipher. Everything
+ *             else, like TLS 1.2 as the oldest version, is Strict_Policy.
+ */
+class TLS_SMP_policy : public Botan::TLS::Strict_Policy
+{
+public:
+  std::vector<std::string> allowed_ciphers() const override
+  {
+    return { "AES-128/GCM", "AES-256/GCM", "ChaCha20Poly1305" };
+  }
+
+  std::vector<std::string> allowed_macs() const override
+  {
+    return { "AEAD" };
+  }
+
+  std::vector<std::string> allowed_key_exchange_methods() const override
+  {
+    return { "ECDH" };
+  }
+
+  std::vector<std::string> allowed_signature_methods() const override
+  {
+    return { "ECDSA", "RSA" };
+  }
+
+  std::vector<std::string> allowed_ecc_curves() const override
+  {
+    return { "x25519", "secp256r1", "secp384r1" };
+  }
+
+  bool server_uses_own_ciphersuite_preferences() const override
+  {
+    return true;
+  }
+};
+
+#endif
@@ -27,6 +27,13 @@ namespace http
     fs::Dirent& ca_cert,
     fs::Dirent& server_key)
   {
+    // connections never leave this CPU, so only it needs credentials
+    if (this->is_affine())
+    {
+      PER_CPU(system).load_credentials(
+          server_name, ca_key, ca_cert, server_key);
+      return;
+    }
     for (int i = 0; i < (int) system.size(); i++)
     {
       SMP::add_task(
@@ -40,51 +47,127 @@ namespace http
     }
   }
 
+  void TLS_SMP_server::add_certificate(fs::Dirent& cert, fs::Dirent& key)
+  {
+    if (this->is_affine())
+    {
+      PER_CPU(system).add_certificate(cert, key);
+      return;
+    }
+    // queued behind load_credentials on every CPU
+    for (int i = 0; i < (int) system.size(); i++)
+    {
+      SMP::add_task(
+      SMP::task_func::make_packed(
+      [this, cert, key] () mutable
+      {
+        PER_CPU(system).add_certificate(cert, key);
+      }), i);
+      SMP::signal(i);
+    }
+  }
+
+  void TLS_SMP_server::load_s2n(
+    const std::string& cert_pem,
+    const std::string& key_pem)
+  {
+    if (this->is_affine())
+    {
+      PER_CPU(system).load_s2n(cert_pem, key_pem);
+      return;
+    }
+    for (int i = 0; i < (int) system.size(); i++)
+    {
+      SMP::add_task(
+      SMP::task_func::make_packed(
+      [this, cert_pem, key_pem] ()
+      {
+        PER_CPU(system).load_s2n(cert_pem, key_pem);
+      }), i);
+      SMP::signal(i);
+    }
+  }
+
+  void TLS_SMP_server::load_openssl(
+    const std::string& cert_pem,
+    const std::string& key_pem)
+  {
+    if (this->is_affine())
+    {
+      PER_CPU(system).load_openssl(cert_pem, key_pem);
+      return;
+    }
+    for (int i = 0; i < (int) system.size(); i++)
+    {
+      SMP::add_task(
+      SMP::task_func::make_packed(
+      [this, cert_pem, key_pem] ()
+      {
+        PER_CPU(system).load_openssl(cert_pem, key_pem);
+      }), i);
+      SMP::signal(i);
+    }
+  }
+
   void TLS_SMP_server::bind(const uint16_t port)
   {
     tcp_.listen(port, {this, &TLS_SMP_server::on_connect});
     INFO("TLS SMP server", "Listening on port %u", port);
   }
 
+  void TLS_SMP_server::set_cpu_split(std::vector<int> handshake,
+                                     std::vector<int> data)
+  {
+    assert(not this->is_affine());
+    for (int cpu : handshake) assert(cpu > 0 && cpu < SMP::cpu_count());
+    for (int cpu : data)      assert(cpu > 0 && cpu < SMP::cpu_count());
+    this->handshake_cpus = std::move(handshake);
+    this->data_cpus      = std::move(data);
+  }
+
   void TLS_SMP_server::on_connect(TCP_conn conn)
   {
-    // round-robin select vcpu
-    static int next_cpu = 1;
-    int current_cpu = next_cpu++;
-    if (next_cpu >= SMP::cpu_count()) next_cpu = 1;
+    int current_cpu = SMP::cpu_id();
+    if (not this->is_affine())
+    {
+      if (handshake_cpus.empty())
+      {
+        for (int cpu = 1; cpu < SMP::cpu_count(); cpu++)
+          handshake_cpus.push_back(cpu);
+      }
+      current_cpu = tls_smp_select_cpu(handshake_cpus);
+    }
 
     // create TCP stream
     auto* ptr = new net::tls::SMP_client(conn, current_cpu);
+    if (not this->data_cpus.empty())
+        ptr->migrate_after_handshake(&this->data_cpus);
 
     // create TLS stream on selected vcpu
-    SMP::add_task(
+    tls_smp_run(current_cpu,
     [this, ptr] ()
     {
       auto& sys = PER_CPU(system);
       net::tls::SMP_client::State_ptr state;
-      state.reset(new net::tls::SMP_TLS_State(
-                  *ptr,
-                  sys.get_rng(),
-                  *sys.credman));
+      state.reset(new net::tls::SMP_TLS_State(*ptr, sys));
       ptr->assign_tls(std::move(state));
-    }, current_cpu);
-    SMP::signal(current_cpu);
+    });
 
     // delay-set callbacks NOTE: don't move!
     ptr->on_connect(
     [this, ptr] (net::Stream&)
     {
       // create and pass TLS socket
-      // this part is run back on main vcpu
-      assert(SMP::cpu_id() == 0);
+      // this part is run back on the TCP vcpu
+      assert(SMP::cpu_id() == tcp_.get_cpuid());
       connect(std::unique_ptr<net::tls::SMP_client>(ptr));
     });
 
     // this is ok due to the created Server_connection inside
     // connect assigns a new on_close
-    ptr->on_close([ptr] {
-      // this part is run back on main vcpu
-      assert(SMP::cpu_id() == 0);
+    ptr->on_close([this, ptr] {
+      // this part is run back on the TCP vcpu
+      assert(SMP::cpu_id() == tcp_.get_cpuid());
       delete ptr;
     });
   }
@@ -23,11 +23,15 @@
 #include <fs/dirent.hpp>
 #include "tls_smp_client.hpp"
 #include "tls_smp_system.hpp"
+#include "tcp_smp.hpp"
 
 namespace http {
 
 /**
  * @brief      A secure HTTPS server.
+ *             On the BSP TCP stack, TLS is offloaded to worker CPUs.
+ *             On a worker TCP stack, TLS stays on that worker.
+ *             TLS is done by Botan, s2n or OpenSSL, see TLS_SMP_engine.
  */
 class TLS_SMP_server : public http::Server
 {
@@ -53,6 +57,18 @@ public:
       net::TCP&   tcp,
       Server_args&&... server_args);
 
+  /**
+   * @brief      Construct a HTTPS server without credentials, for use
+   *             with load_s2n() or load_openssl().
+   *
+   * @param      tcp          The tcp
+   * @param[in]  server_args  A list of args for constructing the underlying HTTP server
+   */
+  template <typename... Server_args>
+  inline explicit TLS_SMP_server(
+      net::TCP&   tcp,
+      Server_args&&... server_args);
+
   /**
    * @brief      Loads credentials.
    *
@@ -67,8 +83,59 @@ public:
       fs::Dirent& ca_cert,
       fs::Dirent& server_key);
 
+  /**
+   * @brief      Adds a certificate/key pair, eg. ECDSA next to RSA.
+   *             Clients get the first type they support, in the order
+   *             preferred by TLS_SMP_policy.
+   *
+   * @param      cert  The certificate, PEM or DER
+   * @param      key   The PKCS8 private key
+   */
+  void add_certificate(fs::Dirent& cert, fs::Dirent& key);
+
+  /**
+   * @brief      Use s2n on every worker CPU instead of Botan.
+   *
+   * @param[in]  cert_pem  The certificate chain, PEM
+   * @param[in]  key_pem   The private key, PEM
+   */
+  void load_s2n(const std::string& cert_pem, const std::string& key_pem);
+
+  /**
+   * @brief      Use OpenSSL on every worker CPU instead of Botan.
+   *
+   * @param[in]  cert_pem  The certificate, PEM
+   * @param[in]  key_pem   The private key, PEM
+   */
+  void load_openssl(const std::string& cert_pem, const std::string& key_pem);
+
+  /**
+   * @brief      Whether TLS runs on the same CPU as the TCP stack.
+   *             This is the case for the per-CPU stacks from tcp_smp.cpp,
+   *             where a connection is processed entirely on one CPU,
+   *             which may also be the BSP.
+   */
+  bool is_affine() const noexcept {
+    return tcp_.get_cpuid() != 0 || tcp_smp_owns(tcp_);
+  }
+
+  /**
+   * @brief      Keeps handshakes away from established streams.
+   *             New connections do their handshake on one of @handshake,
+   *             then move to the least loaded of @data, so a burst of
+   *             handshakes never delays records for existing clients.
+   *             Empty @data keeps connections where they handshook.
+   *             Only for servers on the BSP TCP stack.
+   *
+   * @param[in]  handshake  Worker CPUs for handshakes (empty for all)
+   * @param[in]  data       Worker CPUs for established sessions
+   */
+  void set_cpu_split(std::vector<int> handshake, std::vector<int> data);
+
 private:
   SMP_ARRAY<tls_smp_system> system;
+  std::vector<int> handshake_cpus;
+  std::vector<int> data_cpus;
 
   /**
    * @brief      Binds TCP to pass all new connections to this on_connect.
@@ -99,6 +166,13 @@ inline TLS_SMP_server::TLS_SMP_server(
   load_credentials(name, ca_key, ca_cert, server_key);
 }
 
+template <typename... Server_args>
+inline TLS_SMP_server::TLS_SMP_server(
+    net::TCP&   tcp,
+    Server_args&&... server_args)
+  : Server{tcp, std::forward<Server_args>(server_args)...}
+{}
+
 } // < namespace http
 
 #endif
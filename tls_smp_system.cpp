@@ -16,10 +16,153 @@
 // limitations under the License.
 
 #include "tls_smp_system.hpp"
+#include "tls_session_cache.hpp"
 #include <botan/system_rng.h>
 #include <botan/data_src.h>
 #include <botan/pkcs8.h>
 #include <smp>
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+static SMP_ARRAY<tls_smp_stats> smp_stats;
+static SMP_ARRAY<tls_smp_load>  smp_load;
+
+tls_smp_stats& tls_smp_get_stats(int cpu)
+{
+  return smp_stats.at(cpu);
+}
+
+tls_smp_load& tls_smp_get_load(int cpu)
+{
+  return smp_load.at(cpu);
+}
+
+static tls_smp_coalescing coalescing;
+
+const tls_smp_coalescing& tls_smp_get_coalescing()
+{
+  return coalescing;
+}
+
+void tls_smp_set_coalescing(size_t max_bytes, std::chrono::microseconds delay)
+{
+  coalescing.max_bytes = max_bytes;
+  coalescing.delay     = delay;
+}
+
+static tls_smp_idle idle;
+
+const tls_smp_idle& tls_smp_get_idle()
+{
+  return idle;
+}
+
+void tls_smp_set_idle(std::chrono::milliseconds timeout, size_t read_size)
+{
+  idle.timeout   = timeout;
+  idle.read_size = read_size;
+}
+
+// xorshift state, per CPU since every CPU may accept connections
+struct alignas(SMP_ALIGN) select_seed_t
+{
+  uint32_t value = 0;
+};
+static SMP_ARRAY<select_seed_t> select_seeds;
+
+int tls_smp_select_cpu(const std::vector<int>& cpus)
+{
+  assert(not cpus.empty());
+  const uint32_t count = cpus.size();
+  if (count == 1) return cpus[0];
+
+  auto& seed = PER_CPU(select_seeds).value;
+  // a different sequence on every CPU
+  if (seed == 0) seed = 0x9E3779B9 ^ (SMP::cpu_id() * 0x85EBCA6B);
+  seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+  // two distinct indices
+  const uint32_t a = seed % count;
+  const uint32_t b = (a + 1 + seed / count % (count - 1)) % count;
+
+  if (smp_load.at(cpus[b]).score() < smp_load.at(cpus[a]).score())
+      return cpus[b];
+  return cpus[a];
+}
+
+void tls_smp_print_stats()
+{
+  uint64_t handshakes = 0, full = 0, migrations = 0;
+  for (int cpu = 0; cpu < SMP::cpu_count(); cpu++)
+  {
+    const auto& st = smp_stats[cpu];
+    handshakes += st.handshakes;
+    full += st.full_handshakes;
+    migrations += st.migrations;
+    const auto& load = smp_load[cpu];
+    if (load.sessions || load.handshakes || load.queued_bytes)
+    {
+      printf("TLS SMP CPU %d: load %d: %d sessions, %d handshakes, %lld bytes queued\n",
+             cpu, load.score(), load.sessions.load(), load.handshakes.load(),
+             (long long) load.queued_bytes.load());
+    }
+    if (st.messages == 0) continue;
+    printf("TLS SMP CPU %d: %llu messages, %.2f allocs/msg, %.1f bytes copied/msg,"
+           " %llu writes in %llu batches, %llu segments gathered,"
+           " %llu idle releases, %llu wakeups\n",
+           cpu, (unsigned long long) st.messages,
+           (double) st.buffers_allocated / st.messages,
+           (double) st.bytes_copied / st.messages,
+           (unsigned long long) st.writes_coalesced,
+           (unsigned long long) st.write_batches,
+           (unsigned long long) st.segments_gathered,
+           (unsigned long long) st.idle_releases,
+           (unsigned long long) st.idle_wakeups);
+  }
+  const auto cache = TLS_session_cache::get().get_stats();
+  printf("TLS SMP: %llu handshakes, %llu full, %.1f%% resumed, %llu migrated"
+         " | session cache %llu/%llu hits, %llu evictions | %llu ticket keys\n",
+         (unsigned long long) handshakes, (unsigned long long) full,
+         (handshakes && full <= handshakes) ? 100.0 * (handshakes - full) / handshakes : 0.0,
+         (unsigned long long) migrations,
+         (unsigned long long) cache.hits, (unsigned long long) cache.lookups,
+         (unsigned long long) cache.evictions,
+         (unsigned long long) Session_ticket_keys::get().rotations());
+}
+
+// plaintext joined into one record, see TLS_SMP_engine::sendv()
+static SMP_ARRAY<std::array<uint8_t, 16384>> record_scratch;
+
+void TLS_SMP_engine::sendv(const iovec* iov, size_t count)
+{
+  auto& record = PER_CPU(record_scratch);
+  size_t used = 0;
+  size_t copied = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    auto*  data = (const uint8_t*) iov[i].iov_base;
+    size_t len  = iov[i].iov_len;
+    while (len > 0)
+    {
+      if (used == 0 && len >= record.size()) {
+        this->send(data, len);
+        break;
+      }
+      const size_t n = std::min(len, record.size() - used);
+      std::memcpy(record.data() + used, data, n);
+      copied += n;
+      used += n;
+      data += n;
+      len  -= n;
+      if (used == record.size()) {
+        this->send(record.data(), used);
+        used = 0;
+      }
+    }
+  }
+  if (used > 0) this->send(record.data(), used);
+  tls_smp_get_stats(SMP::cpu_id()).bytes_copied += copied;
+}
 
 Botan::RandomNumberGenerator& tls_smp_system::get_rng() {
   return Botan::system_rng();
@@ -55,5 +198,35 @@ void tls_smp_system::load_credentials(
           Botan::X509_Certificate(vca_cert),
           std::move(srv_key));
 
-  this->credman.reset(credman);
+  this->credman.reset(new TLS_SMP_credman(
+          std::unique_ptr<Botan::Credentials_Manager>(credman)));
+  this->engines = tls_smp_botan_engines(get_rng(), *this->credman);
+}
+
+void tls_smp_system::add_certificate(
+      fs::Dirent& file_cert,
+      fs::Dirent& file_key)
+{
+  assert(this->credman != nullptr);
+  assert(file_cert.is_valid());
+  auto cert = file_cert.read();
+  std::vector<uint8_t> vcert(cert.begin(), cert.end());
+
+  this->credman->add_certificate(
+          { Botan::X509_Certificate(vcert) },
+          read_pkey(file_key));
+}
+
+void tls_smp_system::load_s2n(
+      const std::string& cert_pem,
+      const std::string& key_pem)
+{
+  this->engines = tls_smp_s2n_engines(cert_pem, key_pem);
+}
+
+void tls_smp_system::load_openssl(
+      const std::string& cert_pem,
+      const std::string& key_pem)
+{
+  this->engines = tls_smp_openssl_engines(cert_pem, key_pem);
 }
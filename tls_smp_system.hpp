@@ -22,7 +22,13 @@
 #include <botan/credentials_manager.h>
 #include <net/tls/credman.hpp>
 #include <fs/dirent.hpp>
+#include <atomic>
+#include <chrono>
+#include <vector>
 #include <smp>
+#include "smp_queue.hpp"
+#include "tls_smp_credman.hpp"
+#include "tls_smp_engine.hpp"
 
 //#define TLS_DEBUG 1
 
@@ -37,6 +43,120 @@
 #define TLS_PRINT(fmt, ...) /** fmt **/
 #endif
 
+/**
+ * Per-CPU buffer accounting for the TLS SMP streams.
+ * A message is one TLS record received or one send() of plaintext.
+**/
+struct alignas(SMP_ALIGN) tls_smp_stats
+{
+  uint64_t messages = 0;
+  uint64_t buffers_allocated = 0;
+  uint64_t bytes_copied = 0;
+  // completed handshakes, and those that needed the certificate
+  uint64_t handshakes = 0;
+  uint64_t full_handshakes = 0;
+  // sessions handed from this (handshake) CPU to a data CPU
+  uint64_t migrations = 0;
+  // small writes merged, and the batches they were sent in
+  uint64_t writes_coalesced = 0;
+  uint64_t write_batches = 0;
+  // buffers batched by reference, through writev()
+  uint64_t segments_gathered = 0;
+  // streams that went idle and gave back their buffers, and woke up
+  uint64_t idle_releases = 0;
+  uint64_t idle_wakeups = 0;
+};
+tls_smp_stats& tls_smp_get_stats(int cpu);
+void tls_smp_print_stats();
+
+/**
+ * Live load of a TLS worker CPU, updated from any CPU.
+ * Connections and handshakes are counted from the moment a CPU is
+ * chosen, so a burst of accepts immediately sees its own choices.
+**/
+struct alignas(SMP_ALIGN) tls_smp_load
+{
+  std::atomic<int>     sessions {0};
+  std::atomic<int>     handshakes {0};
+  // received ciphertext and plaintext to send, not yet processed
+  std::atomic<int64_t> queued_bytes {0};
+
+  int score() const noexcept {
+    // a handshake is worth many established sessions
+    return sessions.load(std::memory_order_relaxed)
+         + 16 * handshakes.load(std::memory_order_relaxed)
+         + (int) (queued_bytes.load(std::memory_order_relaxed) / 4096);
+  }
+};
+tls_smp_load& tls_smp_get_load(int cpu);
+
+/**
+ * Power of two choices: the less loaded of two random CPUs from @cpus.
+ * Any CPU may call it, each draws from its own random sequence.
+**/
+int tls_smp_select_cpu(const std::vector<int>& cpus);
+
+/**
+ * Small writes to a TLS stream are gathered and encrypted as one, so that
+ * a burst becomes a few full TLS records and TCP buffers. A batch is sent
+ * when it would grow past @max_bytes, or at the end of the current event
+ * loop iteration when @delay is zero, or after @delay. Writes of at least
+ * @max_bytes go out directly, and 0 turns coalescing off.
+ * Every CPU reads this without locks: set it once, on the BSP, before
+ * the TCP CPUs start.
+**/
+struct tls_smp_coalescing
+{
+  size_t max_bytes = 16384; // a full TLS record
+  std::chrono::microseconds delay {0};
+};
+const tls_smp_coalescing& tls_smp_get_coalescing();
+void tls_smp_set_coalescing(size_t max_bytes,
+                            std::chrono::microseconds delay = {});
+
+/**
+ * Streams without traffic for about @timeout give back their buffers:
+ * the TLS engine's record buffers, and the TCP receive buffer, which
+ * shrinks to @read_size until the next packet arrives. Streams are
+ * swept by their TCP CPU, which read this without locks: set it once,
+ * on the BSP, before the TCP CPUs start.
+ * A timeout of 0 (the default) turns it off.
+**/
+struct tls_smp_idle
+{
+  std::chrono::milliseconds timeout {0};
+  size_t read_size = 512;
+};
+const tls_smp_idle& tls_smp_get_idle();
+void tls_smp_set_idle(std::chrono::milliseconds timeout, size_t read_size = 512);
+
+/**
+ * Run @func on @cpu: directly when already there, otherwise through the
+ * non-allocating SMP_queue. Keeps connection-affine setups free of SMP
+ * round trips.
+**/
+template <typename Func>
+inline void tls_smp_run(int cpu, Func&& func)
+{
+  if (cpu == SMP::cpu_id()) {
+    func();
+  }
+  else {
+    SMP_queue::add_task(std::forward<Func>(func), cpu);
+  }
+}
+
+/**
+ * Run @func on @cpu through SMP_queue, even when already there, so that
+ * it runs once the caller has returned. For calls into user code, which
+ * may close and delete the stream while the caller is still using it.
+**/
+template <typename Func>
+inline void tls_smp_post(int cpu, Func&& func)
+{
+  SMP_queue::add_task(std::forward<Func>(func), cpu);
+}
+
 struct alignas(SMP_ALIGN) tls_smp_system
 {
   static Botan::RandomNumberGenerator& get_rng();
@@ -47,7 +167,21 @@ struct alignas(SMP_ALIGN) tls_smp_system
       fs::Dirent& ca_cert,
       fs::Dirent& server_key);
 
-  std::unique_ptr<Botan::Credentials_Manager> credman;
+  // an additional certificate (PEM or DER) and its PKCS8 key
+  void add_certificate(fs::Dirent& cert, fs::Dirent& key);
+
+  // s2n or OpenSSL instead of Botan, from a PEM certificate and key
+  void load_s2n(const std::string& cert_pem, const std::string& key_pem);
+  void load_openssl(const std::string& cert_pem, const std::string& key_pem);
+
+  std::unique_ptr<TLS_SMP_engine> make_engine(TLS_SMP_engine::Output& out)
+  {
+    assert(engines != nullptr && "No credentials loaded on this CPU");
+    return engines(out);
+  }
+
+  std::unique_ptr<TLS_SMP_credman> credman;
+  tls_smp_engine_factory engines = nullptr;
 };
 
 #endif
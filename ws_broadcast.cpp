@@ -0,0 +1,140 @@
+#include "ws_broadcast.hpp"
+#include "smp_queue.hpp"
+#include <cassert>
+#include <cstdio>
+
+WS_broadcast::WS_broadcast()
+  : m_shards(new shard_t[SMP::cpu_count()]), m_cpus(SMP::cpu_count()) {}
+
+void WS_broadcast::add(WS_stream& ws)
+{
+  auto& shard = m_shards[SMP::cpu_id()];
+  if (shard.index.count(&ws)) return;
+  shard.index[&ws] = shard.members.size();
+  shard.members.push_back(&ws);
+  shard.count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void WS_broadcast::remove(WS_stream& ws)
+{
+  auto& shard = m_shards[SMP::cpu_id()];
+  auto it = shard.index.find(&ws);
+  if (it == shard.index.end()) return;
+  const size_t idx = it->second;
+  shard.index.erase(it);
+  shard.count.fetch_sub(1, std::memory_order_relaxed);
+
+  if (shard.sending) {
+    // the send loop is walking the vector, leave a hole
+    shard.members[idx] = nullptr;
+    shard.removed++;
+    return;
+  }
+  auto* last = shard.members.back();
+  shard.members[idx] = last;
+  shard.members.pop_back();
+  if (last != &ws) shard.index[last] = idx;
+}
+
+void WS_broadcast::compact(shard_t& shard)
+{
+  size_t out = 0;
+  for (auto* ws : shard.members)
+  {
+    if (ws == nullptr) continue;
+    shard.index[ws] = out;
+    shard.members[out++] = ws;
+  }
+  shard.members.resize(out);
+  shard.removed = 0;
+}
+
+size_t WS_broadcast::size() const noexcept
+{
+  size_t total = 0;
+  for (int cpu = 0; cpu < m_cpus; cpu++)
+      total += m_shards[cpu].count.load(std::memory_order_relaxed);
+  return total;
+}
+
+void WS_broadcast::send(const void* data, size_t len, uint8_t op)
+{
+  assert(not ws::is_control(op));
+  // framed once, shared by every member on every CPU
+  buffer_t frame = WS_stream::encode_frame(op, data, len);
+  const size_t hlen = ws::header_length(len);
+
+  const int self = SMP::cpu_id();
+  for (int cpu = 0; cpu < m_cpus; cpu++)
+  {
+    if (cpu == self) continue;
+    if (m_shards[cpu].count.load(std::memory_order_relaxed) == 0) continue;
+    SMP_queue::add_task(
+    [this, frame, hlen, cpu] () {
+      send_local(m_shards[cpu], frame, hlen);
+    }, cpu);
+  }
+  // while the other CPUs are busy with theirs
+  if (m_shards[self].count.load(std::memory_order_relaxed) > 0)
+      send_local(m_shards[self], frame, hlen);
+}
+
+void WS_broadcast::send_local(shard_t& shard, const buffer_t& frame, size_t hlen)
+{
+  const uint8_t  op = frame->at(0) & 0xF;
+  const uint8_t* payload = frame->data() + hlen;
+  const size_t   len = frame->size() - hlen;
+  // compressed frames, by window bits, made by the first member needing one
+  buffer_t deflated[16];
+
+  shard.stats.messages++;
+  shard.sending = true;
+  for (size_t i = 0; i < shard.members.size(); i++)
+  {
+    WS_stream* ws = shard.members[i];
+    if (ws == nullptr || ws->m_closing) continue;
+    if (m_drop_blocked && not ws->get_connection().is_writable()) {
+      shard.stats.dropped++;
+      continue;
+    }
+    shard.stats.frames++;
+
+    auto* def = ws->m_deflater.get();
+    if (def == nullptr || len < ws->m_deflate_min) {
+      shard.stats.shared++;
+      ws->write_frame(frame);
+      continue;
+    }
+    if (def->context_takeover()) {
+      // the window is this member's own
+      ws->write(payload, len, op);
+      continue;
+    }
+    auto& dframe = deflated[def->window_bits()];
+    if (dframe == nullptr)
+    {
+      size_t out_len;
+      const uint8_t* out = def->compress(payload, len, out_len);
+      // no gain: the plain frame will do
+      dframe = (out_len < len) ? WS_stream::encode_frame(op, out, out_len, 0x4) : frame;
+    }
+    shard.stats.shared++;
+    ws->write_frame(dframe);
+  }
+  shard.sending = false;
+  if (shard.removed) compact(shard);
+}
+
+void WS_broadcast::print_stats() const
+{
+  for (int cpu = 0; cpu < m_cpus; cpu++)
+  {
+    const auto& shard = m_shards[cpu];
+    const auto& st = shard.stats;
+    if (st.messages == 0 && shard.count.load() == 0) continue;
+    printf("Broadcast CPU %d: %zu members %llu messages %llu frames (%llu shared)"
+           " %llu dropped\n", cpu, shard.count.load(),
+           (unsigned long long) st.messages, (unsigned long long) st.frames,
+           (unsigned long long) st.shared, (unsigned long long) st.dropped);
+  }
+}
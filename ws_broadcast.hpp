@@ -0,0 +1,87 @@
+#pragma once
+#ifndef WS_BROADCAST_HPP
+#define WS_BROADCAST_HPP
+
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <smp>
+#include "ws_stream.hpp"
+
+/**
+ * A group of WebSocket streams that receive the same messages.
+ *
+ * send() frames a message once, into one shared buffer, and every
+ * member is handed that buffer: no per-member framing or copy. Members
+ * are sharded by the CPU they live on. Each CPU that has members gets the
+ * frame through SMP_queue and writes it to its own streams, so the
+ * sender never touches another CPU's connections. TLS streams still
+ * encrypt the frame once per connection, as each has its own keys.
+ *
+ * Members with permessage-deflate without context takeover share one
+ * compressed frame per CPU and window size. Members that keep a
+ * compression context get their own compressed copy.
+ *
+ * add() and remove() run on the CPU of the stream, and a stream must be
+ * removed before it is deleted, typically from its on_close. The group
+ * must outlive any send() still running on other CPUs.
+**/
+class WS_broadcast
+{
+public:
+  using buffer_t = WS_stream::buffer_t;
+
+  struct stats_t
+  {
+    uint64_t messages = 0;  // sends that reached this CPU
+    uint64_t frames   = 0;  // written to members
+    uint64_t shared   = 0;  // of those, a buffer shared with other members
+    uint64_t dropped  = 0;  // skipped, the member was not writable
+  };
+
+  WS_broadcast();
+
+  void add(WS_stream& ws);
+  void remove(WS_stream& ws);
+
+  /** Members on every CPU */
+  size_t size() const noexcept;
+
+  void send(const void* data, size_t len, uint8_t op = ws::BINARY);
+  void send(const std::string& text, uint8_t op = ws::TEXT)
+  {
+    this->send(text.data(), text.size(), op);
+  }
+
+  /**
+   * Skip members that are not writable, instead of queueing more for
+   * them. A slow subscriber then misses messages rather than growing
+   * its send queue without bound.
+   */
+  void set_drop_when_blocked(bool drop) noexcept { m_drop_blocked = drop; }
+
+  const stats_t& get_stats(int cpu) const { return m_shards[cpu].stats; }
+  void print_stats() const;
+
+private:
+  struct alignas(SMP_ALIGN) shard_t
+  {
+    std::vector<WS_stream*> members;
+    std::unordered_map<WS_stream*, size_t> index;
+    std::atomic<size_t> count {0};
+    // members removed while sending are nulled, and compacted after
+    bool    sending = false;
+    size_t  removed = 0;
+    stats_t stats;
+  };
+
+  void send_local(shard_t&, const buffer_t& frame, size_t header_len);
+  void compact(shard_t&);
+
+  std::unique_ptr<shard_t[]> m_shards;
+  const int m_cpus;
+  bool m_drop_blocked = false;
+};
+
+#endif
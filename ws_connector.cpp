@@ -0,0 +1,74 @@
+#include "ws_connector.hpp"
+#include <botan/base64.h>
+#include <botan/hash.h>
+#include <algorithm>
+#include <cctype>
+
+static const char* WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+std::string WS_connector::accept_key(const std::string& client_key)
+{
+  auto sha1 = Botan::HashFunction::create_or_throw("SHA-1");
+  sha1->update(client_key);
+  sha1->update(WS_GUID);
+  const auto digest = sha1->final();
+  return Botan::base64_encode(digest.data(), digest.size());
+}
+
+// whether the comma-separated @value lists @token, ignoring case
+static bool has_token(std::string value, const std::string& token)
+{
+  std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+  size_t pos = 0;
+  while ((pos = value.find(token, pos)) != std::string::npos)
+  {
+    const size_t end = pos + token.size();
+    const bool starts = pos == 0 || value[pos-1] == ',' || value[pos-1] == ' ';
+    const bool ends = end == value.size() || value[end] == ',' || value[end] == ' ';
+    if (starts && ends) return true;
+    pos = end;
+  }
+  return false;
+}
+
+void WS_connector::handle(http::Request_ptr req, http::Response_writer_ptr writer)
+{
+  const auto& hdr = req->header();
+  const std::string key(hdr.value("Sec-WebSocket-Key"));
+
+  const bool valid = req->method() == http::GET
+      && has_token(std::string(hdr.value("Upgrade")), "websocket")
+      && has_token(std::string(hdr.value("Connection")), "upgrade")
+      && std::string(hdr.value("Sec-WebSocket-Version")) == "13"
+      && key.size() == 24;
+  if (not valid)
+  {
+    writer->write_header(http::Bad_Request);
+    if (on_connect_) on_connect_(nullptr);
+    return;
+  }
+
+  if (on_accept_ and
+      not on_accept_(writer->connection().peer(), std::string(hdr.value("Origin"))))
+  {
+    writer->write_header(http::Unauthorized);
+    if (on_connect_) on_connect_(nullptr);
+    return;
+  }
+
+  writer->header().set_field("Upgrade", "websocket");
+  writer->header().set_field("Connection", "Upgrade");
+  writer->header().set_field("Sec-WebSocket-Accept", accept_key(key));
+  ws::deflate_params params;
+  const bool deflate = deflate_.enabled and
+      ws::negotiate_deflate(std::string(hdr.value("Sec-WebSocket-Extensions")), deflate_, params);
+  if (deflate)
+      writer->header().set_field("Sec-WebSocket-Extensions", params.to_string());
+  writer->write_header(http::Switching_Protocols);
+
+  // the stream is ours from here on
+  auto conn = writer->connection().release();
+  auto ws = deflate ? std::make_unique<WS_stream>(std::move(conn), params, deflate_)
+                    : std::make_unique<WS_stream>(std::move(conn));
+  if (on_connect_) on_connect_(std::move(ws));
+}
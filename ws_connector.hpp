@@ -0,0 +1,39 @@
+#pragma once
+#ifndef WS_CONNECTOR_HPP
+#define WS_CONNECTOR_HPP
+
+#include <net/http/server.hpp>
+#include <net/socket.hpp>
+#include "ws_stream.hpp"
+
+/**
+ * Upgrades HTTP requests to WebSocket connections (RFC 6455 4.2).
+ * Pass handle() to http::Server::on_request. Requests that are not
+ * valid upgrades, or that @on_accept rejects, are answered with an error
+ * and @on_connect gets nullptr. permessage-deflate is negotiated with
+ * clients that offer it, once enabled with set_deflate().
+**/
+class WS_connector
+{
+public:
+  using Connect_handler = delegate<void(WS_stream_ptr)>;
+  using Accept_handler  = delegate<bool(net::Socket, std::string)>;
+
+  WS_connector(Connect_handler on_connect, Accept_handler on_accept = nullptr)
+    : on_connect_(on_connect), on_accept_(on_accept) {}
+
+  void handle(http::Request_ptr req, http::Response_writer_ptr writer);
+
+  void set_deflate(const ws::deflate_options& options) { deflate_ = options; }
+  const ws::deflate_options& deflate() const noexcept { return deflate_; }
+
+  /** Sec-WebSocket-Accept for the client's Sec-WebSocket-Key */
+  static std::string accept_key(const std::string& client_key);
+
+private:
+  Connect_handler on_connect_;
+  Accept_handler  on_accept_;
+  ws::deflate_options deflate_;
+};
+
+#endif
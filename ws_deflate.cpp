@@ -0,0 +1,382 @@
+#include "ws_deflate.hpp"
+#include "ws_frame.hpp"
+#include "buffer_pool.hpp"
+#include <os>
+#include <zlib.h>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <vector>
+
+namespace ws
+{
+  struct zstream
+  {
+    z_stream zs;
+    int  bits;
+    int  level;
+    int  mem_level;
+  };
+
+  // idle streams kept per CPU and kind
+  static const size_t MAX_IDLE = 8;
+
+  struct alignas(SMP_ALIGN) deflate_cpu
+  {
+    std::vector<zstream*> deflaters;
+    std::vector<zstream*> inflaters;
+    // compressed output, before it is framed
+    std::vector<uint8_t>  scratch;
+    // inflated pieces of streamed messages
+    std::array<uint8_t, 16384> pieces;
+    deflate_stats stats;
+  };
+  static SMP_ARRAY<deflate_cpu> cpus;
+
+  static zstream* acquire_deflate(int bits, int level, int mem_level)
+  {
+    auto& idle = PER_CPU(cpus).deflaters;
+    for (size_t i = 0; i < idle.size(); i++)
+    {
+      auto* z = idle[i];
+      if (z->bits == bits && z->level == level && z->mem_level == mem_level) {
+        idle[i] = idle.back();
+        idle.pop_back();
+        return z;
+      }
+    }
+    auto* z = new zstream{};
+    z->bits = bits;
+    z->level = level;
+    z->mem_level = mem_level;
+    // negative window bits: raw deflate, without zlib header or checksum
+    const int res = deflateInit2(&z->zs, level, Z_DEFLATED, -bits, mem_level, Z_DEFAULT_STRATEGY);
+    assert(res == Z_OK);
+    PER_CPU(cpus).stats.streams++;
+    return z;
+  }
+
+  static void release_deflate(zstream* z)
+  {
+    auto& idle = PER_CPU(cpus).deflaters;
+    if (idle.size() < MAX_IDLE) {
+      deflateReset(&z->zs);
+      idle.push_back(z);
+      return;
+    }
+    deflateEnd(&z->zs);
+    delete z;
+  }
+
+  static zstream* acquire_inflate(int bits)
+  {
+    auto& idle = PER_CPU(cpus).inflaters;
+    for (size_t i = 0; i < idle.size(); i++)
+    {
+      auto* z = idle[i];
+      if (z->bits == bits) {
+        idle[i] = idle.back();
+        idle.pop_back();
+        return z;
+      }
+    }
+    auto* z = new zstream{};
+    z->bits = bits;
+    const int res = inflateInit2(&z->zs, -bits);
+    assert(res == Z_OK);
+    PER_CPU(cpus).stats.streams++;
+    return z;
+  }
+
+  static void release_inflate(zstream* z)
+  {
+    auto& idle = PER_CPU(cpus).inflaters;
+    if (idle.size() < MAX_IDLE) {
+      inflateReset(&z->zs);
+      idle.push_back(z);
+      return;
+    }
+    inflateEnd(&z->zs);
+    delete z;
+  }
+
+  deflater::deflater(int bits, bool takeover, int level, int mem_level)
+    : m_bits(bits), m_level(level), m_mem_level(mem_level), m_takeover(takeover) {}
+
+  deflater::~deflater()
+  {
+    if (m_stream) release_deflate(m_stream);
+  }
+
+  const uint8_t* deflater::compress(const uint8_t* data, size_t len, size_t& out_len)
+  {
+    auto& cpu = PER_CPU(cpus);
+    const auto t0 = OS::cycles_since_boot();
+    if (m_stream == nullptr)
+        m_stream = acquire_deflate(m_bits, m_level, m_mem_level);
+
+    auto& zs  = m_stream->zs;
+    auto& out = cpu.scratch;
+    const size_t bound = deflateBound(&zs, len) + 16;
+    if (out.size() < bound) out.resize(bound);
+
+    zs.next_in  = (Bytef*) data;
+    zs.avail_in = len;
+    size_t produced = 0;
+    do {
+      if (out.size() - produced < 64) out.resize(2 * out.size());
+      zs.next_out  = out.data() + produced;
+      zs.avail_out = out.size() - produced;
+      deflate(&zs, Z_SYNC_FLUSH);
+      produced = out.size() - zs.avail_out;
+    } while (zs.avail_out == 0);
+
+    // the flush ends with an empty block, 00 00 ff ff, which is implied
+    assert(produced >= 4);
+    out_len = produced - 4;
+
+    if (not m_takeover) {
+      release_deflate(m_stream);
+      m_stream = nullptr;
+    }
+    cpu.stats.messages++;
+    cpu.stats.raw_bytes += len;
+    cpu.stats.deflated_bytes += out_len;
+    cpu.stats.deflate_cycles += OS::cycles_since_boot() - t0;
+    return out.data();
+  }
+
+  inflater::inflater(int bits, bool takeover)
+    : m_bits(bits), m_takeover(takeover) {}
+
+  inflater::~inflater()
+  {
+    if (m_stream) release_inflate(m_stream);
+  }
+
+  uint16_t inflater::decompress(const uint8_t* data, size_t len, size_t max_size, buffer_t& out)
+  {
+    static const uint8_t tail[4] = { 0x00, 0x00, 0xff, 0xff };
+    auto& cpu = PER_CPU(cpus);
+    const auto t0 = OS::cycles_since_boot();
+    if (m_stream == nullptr)
+        m_stream = acquire_inflate(m_bits);
+
+    auto& zs = m_stream->zs;
+    out = buffer_pool::get(std::min(max_size + 1, 4 * len + 256));
+    out->resize(out->capacity());
+    size_t   produced = 0;
+    uint16_t error = 0;
+    bool     ended = false;
+    // the message, then the empty block the sender left out
+    for (int part = 0; part < 2 && not error && not ended; part++)
+    {
+      zs.next_in  = (Bytef*) (part == 0 ? data : tail);
+      zs.avail_in = (part == 0) ? len : sizeof(tail);
+      do {
+        if (produced == out->size()) {
+          // one byte over the limit tells us the message is too big
+          if (produced > max_size) { error = TOO_BIG; break; }
+          out->resize(std::min(max_size + 1, 2 * out->size()));
+        }
+        zs.next_out  = out->data() + produced;
+        zs.avail_out = out->size() - produced;
+        const int res = inflate(&zs, Z_SYNC_FLUSH);
+        produced = out->size() - zs.avail_out;
+        if (res == Z_STREAM_END) {
+          // a final block, the next message starts over
+          inflateReset(&zs);
+          ended = true;
+          break;
+        }
+        if (res != Z_OK && res != Z_BUF_ERROR) { error = INVALID_DATA; break; }
+      } while (zs.avail_in > 0 || zs.avail_out == 0);
+    }
+    if (produced > max_size) error = TOO_BIG;
+
+    if (error) {
+      out = nullptr;
+      inflateReset(&zs);
+    }
+    else out->resize(produced);
+    if (not m_takeover || error) {
+      release_inflate(m_stream);
+      m_stream = nullptr;
+    }
+    cpu.stats.inflated++;
+    cpu.stats.inflate_in += len;
+    cpu.stats.inflate_out += produced;
+    cpu.stats.inflate_cycles += OS::cycles_since_boot() - t0;
+    return error;
+  }
+
+  uint16_t inflater::decompress_part(const uint8_t* data, size_t len, bool last,
+                                     size_t max_size, size_t& total, Output emit)
+  {
+    static const uint8_t tail[4] = { 0x00, 0x00, 0xff, 0xff };
+    auto& cpu = PER_CPU(cpus);
+    const auto t0 = OS::cycles_since_boot();
+    if (m_stream == nullptr)
+        m_stream = acquire_inflate(m_bits);
+
+    auto& zs  = m_stream->zs;
+    auto& out = cpu.pieces;
+    const size_t before = total;
+    uint16_t error = 0;
+    bool     ended = false;
+    for (int part = 0; part < (last ? 2 : 1) && not error && not ended; part++)
+    {
+      zs.next_in  = (Bytef*) (part == 0 ? data : tail);
+      zs.avail_in = (part == 0) ? len : sizeof(tail);
+      do {
+        zs.next_out  = out.data();
+        zs.avail_out = out.size();
+        const int res = inflate(&zs, Z_SYNC_FLUSH);
+        const size_t n = out.size() - zs.avail_out;
+        total += n;
+        if (total > max_size) { error = TOO_BIG; break; }
+        if (n > 0) emit(out.data(), n);
+        if (res == Z_STREAM_END) {
+          inflateReset(&zs);
+          ended = true;
+          break;
+        }
+        if (res != Z_OK && res != Z_BUF_ERROR) { error = INVALID_DATA; break; }
+      } while (zs.avail_in > 0 || zs.avail_out == 0);
+    }
+
+    if (error) inflateReset(&zs);
+    if ((last && not m_takeover) || error) {
+      release_inflate(m_stream);
+      m_stream = nullptr;
+    }
+    if (last) cpu.stats.inflated++;
+    cpu.stats.inflate_in += len;
+    cpu.stats.inflate_out += total - before;
+    cpu.stats.inflate_cycles += OS::cycles_since_boot() - t0;
+    return error;
+  }
+
+  /// negotiation ///
+
+  static std::string trim(const std::string& str)
+  {
+    const size_t start = str.find_first_not_of(" \t");
+    if (start == std::string::npos) return "";
+    const size_t end = str.find_last_not_of(" \t");
+    return str.substr(start, end - start + 1);
+  }
+
+  // 8-15, or -1
+  static int parse_bits(const std::string& value)
+  {
+    if (value.size() < 1 || value.size() > 2) return -1;
+    if (not std::all_of(value.begin(), value.end(), ::isdigit)) return -1;
+    const int bits = std::stoi(value);
+    return (bits >= 8 && bits <= 15) ? bits : -1;
+  }
+
+  static bool accept_offer(const std::string& offer, const deflate_options& opts,
+                           deflate_params& result)
+  {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (true) {
+      const size_t end = offer.find(';', start);
+      parts.push_back(trim(offer.substr(start, end - start)));
+      if (end == std::string::npos) break;
+      start = end + 1;
+    }
+    if (parts[0] != "permessage-deflate") return false;
+
+    deflate_params p;
+    p.server_window_bits = opts.server_max_window_bits;
+    p.client_window_bits = 15;
+    p.server_context_takeover = opts.server_context_takeover;
+    p.client_context_takeover = opts.client_context_takeover;
+    std::vector<std::string> seen;
+    for (size_t i = 1; i < parts.size(); i++)
+    {
+      const size_t eq = parts[i].find('=');
+      const std::string name = trim(parts[i].substr(0, eq));
+      std::string value = (eq == std::string::npos) ? "" : trim(parts[i].substr(eq + 1));
+      if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+          value = value.substr(1, value.size() - 2);
+      // each parameter at most once (RFC 7692 7)
+      if (std::find(seen.begin(), seen.end(), name) != seen.end()) return false;
+      seen.push_back(name);
+
+      if (name == "server_no_context_takeover" || name == "client_no_context_takeover") {
+        if (eq != std::string::npos) return false;
+        if (name[0] == 's') p.server_context_takeover = false;
+        else                p.client_context_takeover = false;
+      }
+      else if (name == "server_max_window_bits") {
+        const int bits = parse_bits(value);
+        if (bits < 0) return false;
+        p.server_window_bits = std::min(p.server_window_bits, bits);
+      }
+      else if (name == "client_max_window_bits") {
+        // the client can limit its window, optionally up to a size
+        const int bits = (eq == std::string::npos) ? 15 : parse_bits(value);
+        if (bits < 0) return false;
+        p.client_window_bits = std::min(opts.client_max_window_bits, bits);
+      }
+      else return false;
+    }
+    // zlib turns an 8-bit raw deflate window into 9 bits
+    if (p.server_window_bits < 9) return false;
+    result = p;
+    return true;
+  }
+
+  bool negotiate_deflate(const std::string& offers, const deflate_options& opts,
+                         deflate_params& result)
+  {
+    size_t start = 0;
+    while (start <= offers.size())
+    {
+      size_t end = offers.find(',', start);
+      if (end == std::string::npos) end = offers.size();
+      if (accept_offer(offers.substr(start, end - start), opts, result)) return true;
+      start = end + 1;
+    }
+    return false;
+  }
+
+  std::string deflate_params::to_string() const
+  {
+    std::string str = "permessage-deflate";
+    if (not server_context_takeover) str += "; server_no_context_takeover";
+    if (not client_context_takeover) str += "; client_no_context_takeover";
+    if (server_window_bits < 15)
+        str += "; server_max_window_bits=" + std::to_string(server_window_bits);
+    // only below 15 when the client offered the parameter
+    if (client_window_bits < 15)
+        str += "; client_max_window_bits=" + std::to_string(client_window_bits);
+    return str;
+  }
+
+  const deflate_stats& get_deflate_stats(int cpu)
+  {
+    return cpus.at(cpu).stats;
+  }
+
+  void print_deflate_stats()
+  {
+    for (int cpu = 0; cpu < SMP::cpu_count(); cpu++)
+    {
+      const auto& st = cpus[cpu].stats;
+      if (st.messages == 0 && st.inflated == 0) continue;
+      printf("Deflate CPU %d: %llu messages %.1f%% of %llu bytes %.2f cycles/byte,"
+             " %llu inflated %.2f cycles/byte, %llu streams\n", cpu,
+             (unsigned long long) st.messages,
+             st.raw_bytes ? 100.0 * st.deflated_bytes / st.raw_bytes : 0.0,
+             (unsigned long long) st.raw_bytes,
+             st.raw_bytes ? (double) st.deflate_cycles / st.raw_bytes : 0.0,
+             (unsigned long long) st.inflated,
+             st.inflate_out ? (double) st.inflate_cycles / st.inflate_out : 0.0,
+             (unsigned long long) st.streams);
+    }
+  }
+}
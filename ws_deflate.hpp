@@ -0,0 +1,137 @@
+#pragma once
+#ifndef WS_DEFLATE_HPP
+#define WS_DEFLATE_HPP
+
+#include <net/stream.hpp>
+#include <smp>
+#include <delegate>
+#include <cstdint>
+#include <string>
+
+/**
+ * permessage-deflate (RFC 7692).
+ *
+ * zlib streams are expensive: about 256 KB to deflate and 40 KB to
+ * inflate with the default 15 window bits. Each CPU keeps a pool of idle,
+ * initialized streams. Without context takeover a connection borrows a
+ * stream for one message and resets it, so a few streams serve every
+ * connection on the CPU. With context takeover the window must survive
+ * between messages, and the connection holds its stream until it closes.
+**/
+namespace ws
+{
+  struct deflate_options
+  {
+    bool   enabled = false;
+    // our LZ77 window, 9-15 (zlib cannot make 8-bit raw streams)
+    int    server_max_window_bits = 15;
+    // the largest client window we ask for, when the client lets us.
+    // Only spares the client: we always inflate with 15 bits
+    int    client_max_window_bits = 15;
+    // keeping the window between messages compresses better, but then
+    // every connection owns its own zlib state
+    bool   server_context_takeover = false;
+    bool   client_context_takeover = false;
+    int    level = 6;
+    int    mem_level = 8;
+    // smaller messages are sent uncompressed: resetting a zlib stream
+    // costs more than deflate saves on them
+    size_t min_size = 128;
+  };
+
+  // what was agreed with one client
+  struct deflate_params
+  {
+    int  server_window_bits = 15;
+    int  client_window_bits = 15;
+    bool server_context_takeover = true;
+    bool client_context_takeover = true;
+
+    /** The Sec-WebSocket-Extensions response for these parameters */
+    std::string to_string() const;
+  };
+
+  /**
+   * Picks the first permessage-deflate offer in the client's
+   * Sec-WebSocket-Extensions that we can accept.
+   * Returns false when there is none.
+   */
+  bool negotiate_deflate(const std::string& offers, const deflate_options&,
+                         deflate_params& result);
+
+  struct zstream;
+
+  /** Compresses messages for one direction of a connection */
+  class deflater
+  {
+  public:
+    deflater(int window_bits, bool context_takeover, int level = 6, int mem_level = 8);
+    ~deflater();
+
+    /**
+     * Compresses one message. The result lives in a per-CPU scratch
+     * buffer and is valid until the next message is compressed on this CPU.
+     */
+    const uint8_t* compress(const uint8_t* data, size_t len, size_t& out_len);
+
+    // whether the peer keeps a window of every message we compress
+    bool context_takeover() const noexcept { return m_takeover; }
+    int  window_bits() const noexcept { return m_bits; }
+
+  private:
+    zstream* m_stream = nullptr;
+    int  m_bits;
+    int  m_level;
+    int  m_mem_level;
+    bool m_takeover;
+  };
+
+  /** Decompresses messages for one direction of a connection */
+  class inflater
+  {
+  public:
+    using buffer_t = net::Stream::buffer_t;
+
+    inflater(int window_bits, bool context_takeover);
+    ~inflater();
+
+    /**
+     * Decompresses one message, of at most @max_size bytes, into @out.
+     * Returns 0, or the close code to fail the connection with.
+     */
+    uint16_t decompress(const uint8_t* data, size_t len, size_t max_size, buffer_t& out);
+
+    using Output = delegate<void(const uint8_t*, size_t)>;
+    /**
+     * Decompresses part of a message, handing the output to @emit in
+     * pieces as it is produced. @last is the end of the message. @total
+     * counts the output of the message so far, up to @max_size.
+     * Returns 0, or the close code to fail the connection with.
+     */
+    uint16_t decompress_part(const uint8_t* data, size_t len, bool last,
+                             size_t max_size, size_t& total, Output emit);
+
+  private:
+    zstream* m_stream = nullptr;
+    int  m_bits;
+    bool m_takeover;
+  };
+
+  struct alignas(SMP_ALIGN) deflate_stats
+  {
+    uint64_t messages = 0;      // compressed
+    uint64_t raw_bytes = 0;
+    uint64_t deflated_bytes = 0;
+    uint64_t deflate_cycles = 0;
+    uint64_t inflated = 0;      // messages decompressed
+    uint64_t inflate_in = 0;
+    uint64_t inflate_out = 0;
+    uint64_t inflate_cycles = 0;
+    uint64_t streams = 0;       // zlib streams created
+  };
+
+  const deflate_stats& get_deflate_stats(int cpu);
+  void print_deflate_stats();
+}
+
+#endif
@@ -0,0 +1,130 @@
+#pragma once
+#ifndef WS_FRAME_HPP
+#define WS_FRAME_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace ws
+{
+  enum op_code : uint8_t {
+    CONTINUE = 0x0,
+    TEXT     = 0x1,
+    BINARY   = 0x2,
+    CLOSE    = 0x8,
+    PING     = 0x9,
+    PONG     = 0xA
+  };
+
+  // RFC 6455 7.4.1
+  enum close_code : uint16_t {
+    NORMAL         = 1000,
+    GOING_AWAY     = 1001,
+    PROTOCOL_ERROR = 1002,
+    UNSUPPORTED    = 1003,
+    NO_STATUS      = 1005,
+    ABNORMAL       = 1006,
+    INVALID_DATA   = 1007,
+    POLICY         = 1008,
+    TOO_BIG        = 1009,
+    INTERNAL_ERROR = 1011
+  };
+
+  inline bool is_control(uint8_t op) noexcept { return op & 0x8; }
+
+  // RFC 6455 7.4: codes a peer may send in a close frame
+  inline bool valid_close_code(uint16_t code) noexcept
+  {
+    if (code < 1000 || code > 4999) return false;
+    // reserved, or only for reporting a close that had no frame
+    return code != 1004 && code != NO_STATUS && code != ABNORMAL && code != 1015;
+  }
+
+  // largest header a server sends: 2 + 8 bytes length, never masked
+  static const size_t MAX_SERVER_HEADER = 10;
+
+  struct frame_header
+  {
+    bool     fin;
+    uint8_t  rsv;    // RSV1-3, in the low bits
+    uint8_t  opcode;
+    bool     masked;
+    uint8_t  mask[4];
+    uint64_t length;  // payload length
+    size_t   header_length;
+
+    /**
+     * Parses a header from @data.
+     * Returns the header length, 0 when more data is needed,
+     * or -1 for a header that violates the RFC.
+     */
+    int parse(const uint8_t* data, size_t len) noexcept
+    {
+      if (len < 2) return 0;
+      fin    = data[0] & 0x80;
+      rsv    = (data[0] >> 4) & 0x7;
+      opcode = data[0] & 0xF;
+      masked = data[1] & 0x80;
+      length = data[1] & 0x7F;
+      size_t pos = 2;
+      if (length == 126)
+      {
+        if (len < 4) return 0;
+        length = (data[2] << 8) | data[3];
+        pos = 4;
+      }
+      else if (length == 127)
+      {
+        if (len < 10) return 0;
+        length = 0;
+        for (int i = 0; i < 8; i++) length = (length << 8) | data[2 + i];
+        // the most significant bit must be 0
+        if (length >> 63) return -1;
+        pos = 10;
+      }
+      if (masked)
+      {
+        if (len < pos + 4) return 0;
+        std::memcpy(mask, data + pos, 4);
+        pos += 4;
+      }
+      // control frames are never fragmented and carry at most 125 bytes
+      if (is_control(opcode) && (not fin || length > 125)) return -1;
+      header_length = pos;
+      return pos;
+    }
+  };
+
+  /**
+   * Writes an unmasked (server) frame header into @out, which must have
+   * room for MAX_SERVER_HEADER bytes. Returns the header length.
+   */
+  inline size_t encode_header(uint8_t* out, uint8_t opcode, uint64_t length,
+                              bool fin = true, uint8_t rsv = 0) noexcept
+  {
+    out[0] = (fin ? 0x80 : 0) | ((rsv & 0x7) << 4) | (opcode & 0xF);
+    if (length < 126)
+    {
+      out[1] = length;
+      return 2;
+    }
+    if (length <= 0xFFFF)
+    {
+      out[1] = 126;
+      out[2] = length >> 8;
+      out[3] = length;
+      return 4;
+    }
+    out[1] = 127;
+    for (int i = 0; i < 8; i++) out[2 + i] = length >> (56 - 8 * i);
+    return 10;
+  }
+
+  inline size_t header_length(uint64_t length) noexcept
+  {
+    return (length < 126) ? 2 : (length <= 0xFFFF) ? 4 : 10;
+  }
+}
+
+#endif
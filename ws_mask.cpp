@@ -0,0 +1,106 @@
+#include "ws_mask.hpp"
+#include <cpuid.h>
+#include <cstring>
+#include <immintrin.h>
+
+// the key as it applies from @offset onwards, as one 32-bit word
+static inline uint32_t rotated_key(const uint8_t key[4], size_t offset) noexcept
+{
+  const uint8_t bytes[4] = {
+    key[(offset + 0) & 3], key[(offset + 1) & 3],
+    key[(offset + 2) & 3], key[(offset + 3) & 3]
+  };
+  uint32_t word;
+  std::memcpy(&word, bytes, 4);
+  return word;
+}
+
+void ws_mask_scalar(uint8_t* data, size_t len, const uint8_t key[4], size_t offset)
+{
+  for (size_t i = 0; i < len; i++)
+      data[i] ^= key[(offset + i) & 3];
+}
+
+void ws_mask_sse2(uint8_t* data, size_t len, const uint8_t key[4], size_t offset)
+{
+  // unaligned head, until data is 16-byte aligned
+  size_t head = (16 - ((uintptr_t) data & 15)) & 15;
+  if (head > len) head = len;
+  ws_mask_scalar(data, head, key, offset);
+  data += head; len -= head; offset += head;
+
+  const __m128i mask = _mm_set1_epi32(rotated_key(key, offset));
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64)
+  {
+    auto* p = (__m128i*) (data + i);
+    _mm_store_si128(p + 0, _mm_xor_si128(_mm_load_si128(p + 0), mask));
+    _mm_store_si128(p + 1, _mm_xor_si128(_mm_load_si128(p + 1), mask));
+    _mm_store_si128(p + 2, _mm_xor_si128(_mm_load_si128(p + 2), mask));
+    _mm_store_si128(p + 3, _mm_xor_si128(_mm_load_si128(p + 3), mask));
+  }
+  for (; i + 16 <= len; i += 16)
+  {
+    auto* p = (__m128i*) (data + i);
+    _mm_store_si128(p, _mm_xor_si128(_mm_load_si128(p), mask));
+  }
+  // tail, 16 is a multiple of 4 so the key phase is unchanged
+  ws_mask_scalar(data + i, len - i, key, offset + i);
+}
+
+__attribute__((target("avx2")))
+void ws_mask_avx2(uint8_t* data, size_t len, const uint8_t key[4], size_t offset)
+{
+  size_t head = (32 - ((uintptr_t) data & 31)) & 31;
+  if (head > len) head = len;
+  ws_mask_scalar(data, head, key, offset);
+  data += head; len -= head; offset += head;
+
+  const __m256i mask = _mm256_set1_epi32(rotated_key(key, offset));
+  size_t i = 0;
+  for (; i + 128 <= len; i += 128)
+  {
+    auto* p = (__m256i*) (data + i);
+    _mm256_store_si256(p + 0, _mm256_xor_si256(_mm256_load_si256(p + 0), mask));
+    _mm256_store_si256(p + 1, _mm256_xor_si256(_mm256_load_si256(p + 1), mask));
+    _mm256_store_si256(p + 2, _mm256_xor_si256(_mm256_load_si256(p + 2), mask));
+    _mm256_store_si256(p + 3, _mm256_xor_si256(_mm256_load_si256(p + 3), mask));
+  }
+  for (; i + 32 <= len; i += 32)
+  {
+    auto* p = (__m256i*) (data + i);
+    _mm256_store_si256(p, _mm256_xor_si256(_mm256_load_si256(p), mask));
+  }
+  ws_mask_scalar(data + i, len - i, key, offset + i);
+}
+
+bool ws_mask_has_avx2() noexcept
+{
+  unsigned eax, ebx, ecx, edx;
+  if (not __get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+  // AVX, and the OS saving YMM state
+  if (not (ecx & bit_AVX) || not (ecx & bit_OSXSAVE)) return false;
+  uint32_t xcr0_lo, xcr0_hi;
+  asm volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  if ((xcr0_lo & 0x6) != 0x6) return false;
+  if (not __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+  return ebx & bit_AVX2;
+}
+
+using mask_func = void(*)(uint8_t*, size_t, const uint8_t*, size_t);
+static const mask_func kernel = ws_mask_has_avx2() ? &ws_mask_avx2 : &ws_mask_sse2;
+
+void ws_mask(uint8_t* data, size_t len, const uint8_t key[4], size_t offset)
+{
+  // not worth setting up vectors for
+  if (len < 32) {
+    ws_mask_scalar(data, len, key, offset);
+    return;
+  }
+  kernel(data, len, key, offset);
+}
+
+const char* ws_mask_kernel() noexcept
+{
+  return (kernel == &ws_mask_avx2) ? "AVX2" : "SSE2";
+}
@@ -0,0 +1,26 @@
+#pragma once
+#ifndef WS_MASK_HPP
+#define WS_MASK_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * XOR @data with the 4-byte WebSocket masking @key, in place. @offset is
+ * the position of @data within the masked payload, so a payload can be
+ * unmasked in pieces. Masking and unmasking are the same operation.
+ *
+ * Uses the widest kernel the CPU supports, chosen once at startup.
+**/
+void ws_mask(uint8_t* data, size_t len, const uint8_t key[4], size_t offset = 0);
+
+// the individual kernels, for testing and benchmarking
+void ws_mask_scalar(uint8_t* data, size_t len, const uint8_t key[4], size_t offset);
+void ws_mask_sse2(uint8_t* data, size_t len, const uint8_t key[4], size_t offset);
+void ws_mask_avx2(uint8_t* data, size_t len, const uint8_t key[4], size_t offset);
+
+bool ws_mask_has_avx2() noexcept;
+// name of the kernel ws_mask() uses
+const char* ws_mask_kernel() noexcept;
+
+#endif
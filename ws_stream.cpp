@@ -0,0 +1,389 @@
+#include "ws_stream.hpp"
+#include "ws_mask.hpp"
+#include "ws_utf8.hpp"
+#include "buffer_pool.hpp"
+#include <algorithm>
+#include <cstring>
+
+WS_stream::WS_stream(Stream_ptr stream)
+  : m_stream(std::move(stream)),
+    m_gather(dynamic_cast<Gather_stream*>(m_stream.get()))
+{
+  m_stream->on_read(READ_SIZE, {this, &WS_stream::read_data});
+  m_stream->on_close({this, &WS_stream::stream_closed});
+}
+
+WS_stream::WS_stream(Stream_ptr stream, const ws::deflate_params& params,
+                     const ws::deflate_options& options)
+  : WS_stream(std::move(stream))
+{
+  m_deflater = std::make_unique<ws::deflater>(params.server_window_bits,
+      params.server_context_takeover, options.level, options.mem_level);
+  // the full window inflates any client, even zlib ones that were
+  // told 8 bits and deflate with 9
+  m_inflater = std::make_unique<ws::inflater>(15, params.client_context_takeover);
+  m_deflate_min = options.min_size;
+}
+
+WS_stream::~WS_stream()
+{
+  if (m_close_timer != Timers::UNUSED_ID) Timers::stop(m_close_timer);
+  m_stream->reset_callbacks();
+}
+
+void WS_stream::read_data(buffer_t buf)
+{
+  m_reading = true;
+  read_frames(std::move(buf));
+  m_reading = false;
+  // closed by a handler, or by fail(): nothing touches this any more
+  if (m_closed && on_close) on_close(m_close_code);
+}
+
+void WS_stream::read_frames(buffer_t buf)
+{
+  // continue a frame from the last read
+  if (m_partial != nullptr)
+  {
+    m_partial->insert(m_partial->end(), buf->begin(), buf->end());
+    buf = std::move(m_partial);
+    m_partial = nullptr;
+  }
+
+  uint8_t* data = buf->data();
+  size_t   len  = buf->size();
+  while (len > 0)
+  {
+    // the rest of a streamed frame, unmasked where it lies
+    if (m_frame_left > 0)
+    {
+      const size_t n = std::min((uint64_t) len, m_frame_left);
+      ws_mask(data, n, m_frame_mask, m_frame_pos);
+      m_frame_pos   = (m_frame_pos + n) & 3;
+      m_frame_left -= n;
+      const bool last = m_frame_left == 0 && m_frame_fin;
+      if (not stream_chunk(data, n, last, buf)) return;
+      data += n;
+      len  -= n;
+      continue;
+    }
+
+    ws::frame_header hdr;
+    const int hlen = hdr.parse(data, len);
+    if (hlen < 0 || (hlen > 0 && not hdr.masked) || (hlen > 0 && not valid_rsv(hdr))) {
+      fail(ws::PROTOCOL_ERROR);
+      return;
+    }
+    if (hlen > 0 && hdr.length > m_max_message) {
+      fail(ws::TOO_BIG);
+      return;
+    }
+    if (hlen > 0 && on_chunk && not ws::is_control(hdr.opcode))
+    {
+      if (not begin_chunks(hdr)) return;
+      data += hlen;
+      len  -= hlen;
+      std::memcpy(m_frame_mask, hdr.mask, 4);
+      m_frame_fin  = hdr.fin;
+      m_frame_left = hdr.length;
+      m_frame_pos  = 0;
+      if (hdr.length == 0 && hdr.fin) {
+        if (not stream_chunk(data, 0, true, buf)) return;
+      }
+      continue;
+    }
+    if (hlen == 0 || len - hlen < hdr.length) break;
+
+    uint8_t* payload = data + hlen;
+    ws_mask(payload, hdr.length, hdr.mask);
+    if (not process_frame(hdr, payload)) return;
+    data += hlen + hdr.length;
+    len  -= hlen + hdr.length;
+  }
+  if (len > 0)
+  {
+    // keep the buffer itself when nothing in it was used (or handed
+    // out), unless most of it would sit there empty
+    if (data == buf->data() && 2 * len >= buf->capacity())
+        m_partial = std::move(buf);
+    else
+        m_partial = buffer_pool::copy(data, len);
+  }
+}
+
+bool WS_stream::valid_rsv(const ws::frame_header& hdr) const noexcept
+{
+  if (hdr.rsv == 0) return true;
+  // RSV1 marks the first frame of a compressed message
+  return hdr.rsv == 0x4 && m_inflater != nullptr
+      && (hdr.opcode == ws::TEXT || hdr.opcode == ws::BINARY);
+}
+
+bool WS_stream::process_frame(const ws::frame_header& hdr, uint8_t* payload)
+{
+  const size_t len = hdr.length;
+  switch (hdr.opcode)
+  {
+  case ws::TEXT:
+  case ws::BINARY:
+    if (m_message != nullptr) {
+      fail(ws::PROTOCOL_ERROR);
+      return false;
+    }
+    m_message_deflated = hdr.rsv & 0x4;
+    if (hdr.fin) {
+      if (m_message_deflated)
+          inflate_and_deliver(hdr.opcode, payload, len);
+      else
+          deliver(hdr.opcode, buffer_pool::copy(payload, len));
+      return not m_closing;
+    }
+    m_message = buffer_pool::get(2 * len);
+    m_message_op = hdr.opcode;
+    m_message->insert(m_message->end(), payload, payload + len);
+    return true;
+
+  case ws::CONTINUE:
+    if (m_message == nullptr) {
+      fail(ws::PROTOCOL_ERROR);
+      return false;
+    }
+    if (m_message->size() + len > m_max_message) {
+      fail(ws::TOO_BIG);
+      return false;
+    }
+    m_message->insert(m_message->end(), payload, payload + len);
+    if (hdr.fin) {
+      auto msg = std::move(m_message);
+      m_message = nullptr;
+      if (m_message_deflated)
+          inflate_and_deliver(m_message_op, msg->data(), msg->size());
+      else
+          deliver(m_message_op, std::move(msg));
+      return not m_closing;
+    }
+    return true;
+
+  case ws::CLOSE:
+    if (len == 1) {
+      fail(ws::PROTOCOL_ERROR);
+      return false;
+    }
+    // the reason after the code is text too
+    if (len > 2 && not utf8_valid(payload + 2, len - 2)) {
+      fail(ws::INVALID_DATA);
+      return false;
+    }
+    m_close_code = ws::NO_STATUS;
+    if (len >= 2) {
+      const uint16_t code = (payload[0] << 8) | payload[1];
+      if (not ws::valid_close_code(code)) {
+        fail(ws::PROTOCOL_ERROR);
+        return false;
+      }
+      m_close_code = code;
+    }
+    // answer with the same code, unless this is the answer
+    if (not m_closing) {
+      m_closing = true;
+      send_frame(ws::CLOSE, payload, (len >= 2) ? 2 : 0);
+    }
+    m_stream->close();
+    return false;
+
+  case ws::PING:
+    if (not m_closing) send_frame(ws::PONG, payload, len);
+    return true;
+
+  case ws::PONG:
+    return true;
+
+  default:
+    fail(ws::PROTOCOL_ERROR);
+    return false;
+  }
+}
+
+void WS_stream::inflate_and_deliver(uint8_t op, const uint8_t* data, size_t len)
+{
+  buffer_t buf;
+  const uint16_t error = m_inflater->decompress(data, len, m_max_message, buf);
+  if (error) {
+    fail(error);
+    return;
+  }
+  deliver(op, std::move(buf));
+}
+
+void WS_stream::deliver(uint8_t op, buffer_t buf)
+{
+  // validated whole, since a sequence may straddle fragments
+  if (op == ws::TEXT && not utf8_valid(buf->data(), buf->size())) {
+    fail(ws::INVALID_DATA);
+    return;
+  }
+  if (on_read) on_read(std::make_unique<WS_message>(op, std::move(buf)));
+}
+
+bool WS_stream::begin_chunks(const ws::frame_header& hdr)
+{
+  if (hdr.opcode == ws::CONTINUE)
+  {
+    if (m_chunk_op == 0) {
+      fail(ws::PROTOCOL_ERROR);
+      return false;
+    }
+    // inflated messages are checked as they are inflated
+    if (not m_chunk_deflated && m_chunk_total + hdr.length > m_max_message) {
+      fail(ws::TOO_BIG);
+      return false;
+    }
+    return true;
+  }
+  if (m_chunk_op != 0 || (hdr.opcode != ws::TEXT && hdr.opcode != ws::BINARY)) {
+    fail(ws::PROTOCOL_ERROR);
+    return false;
+  }
+  m_chunk_op = hdr.opcode;
+  m_chunk_first = true;
+  m_chunk_deflated = hdr.rsv & 0x4;
+  m_chunk_total = 0;
+  m_utf8.reset();
+  return true;
+}
+
+bool WS_stream::stream_chunk(const uint8_t* data, size_t len, bool last,
+                             const buffer_t& buf)
+{
+  if (not m_chunk_deflated)
+  {
+    m_chunk_total += len;
+    // nothing to tell until there is data, or the message ends
+    if (len == 0 && not last) return true;
+    return emit_chunk(data, len, last, buf);
+  }
+  const uint16_t error = m_inflater->decompress_part(data, len, last,
+      m_max_message, m_chunk_total, {this, &WS_stream::emit_inflated});
+  if (error) {
+    fail(error);
+    return false;
+  }
+  if (m_closing) return false;
+  return last ? emit_chunk(nullptr, 0, true, nullptr) : true;
+}
+
+void WS_stream::emit_inflated(const uint8_t* data, size_t len)
+{
+  emit_chunk(data, len, false, nullptr);
+}
+
+bool WS_stream::emit_chunk(const uint8_t* data, size_t len, bool last,
+                           const buffer_t& buf)
+{
+  if (m_closing) return false;
+  // a character may straddle chunks, the validator keeps its start
+  if (m_chunk_op == ws::TEXT &&
+      (not m_utf8.feed(data, len) || (last && not m_utf8.finish()))) {
+    fail(ws::INVALID_DATA);
+    return false;
+  }
+  const WS_chunk chunk { m_chunk_op, data, len, m_chunk_first, last, buf };
+  m_chunk_first = false;
+  if (last) m_chunk_op = 0;
+  if (on_chunk) on_chunk(chunk);
+  return not m_closing;
+}
+
+WS_stream::buffer_t WS_stream::encode_frame(uint8_t op, const void* data, size_t len, uint8_t rsv)
+{
+  auto buf = buffer_pool::get(ws::MAX_SERVER_HEADER + len);
+  buf->resize(ws::MAX_SERVER_HEADER);
+  buf->resize(ws::encode_header(buf->data(), op, len, true, rsv));
+  auto* bytes = (const uint8_t*) data;
+  buf->insert(buf->end(), bytes, bytes + len);
+  return buf;
+}
+
+void WS_stream::send_frame(uint8_t op, const void* data, size_t len, uint8_t rsv)
+{
+  m_stream->write(encode_frame(op, data, len, rsv));
+}
+
+void WS_stream::write_frame(buffer_t frame)
+{
+  if (m_closing) return;
+  m_stream->write(std::move(frame));
+}
+
+void WS_stream::write(const void* data, size_t len, uint8_t op)
+{
+  if (m_closing) return;
+  if (m_deflater && len >= m_deflate_min)
+  {
+    size_t out_len;
+    const uint8_t* out = m_deflater->compress((const uint8_t*) data, len, out_len);
+    // without a shared window, a message that did not shrink can go as is
+    if (out_len < len || m_deflater->context_takeover()) {
+      send_frame(op, out, out_len, 0x4);
+      return;
+    }
+  }
+  send_frame(op, data, len);
+}
+
+void WS_stream::write(buffer_t payload, uint8_t op)
+{
+  const size_t len = payload->size();
+  const bool deflate = m_deflater && len >= m_deflate_min;
+  if (m_closing || m_gather == nullptr || deflate) {
+    this->write(payload->data(), len, op);
+    return;
+  }
+  // the header in a buffer of its own, the payload as it is
+  auto header = buffer_pool::get(ws::MAX_SERVER_HEADER);
+  header->resize(ws::MAX_SERVER_HEADER);
+  header->resize(ws::encode_header(header->data(), op, len));
+  const buffer_t frame[2] = { std::move(header), std::move(payload) };
+  m_gather->writev(frame, 2);
+}
+
+void WS_stream::close(uint16_t code)
+{
+  if (m_closing) return;
+  m_closing = true;
+  const uint8_t payload[2] = { uint8_t(code >> 8), uint8_t(code) };
+  send_frame(ws::CLOSE, payload, sizeof(payload));
+  // a client that never answers is closed on anyway
+  m_close_timer = Timers::oneshot(CLOSE_TIMEOUT,
+  [this] (int) {
+    m_close_timer = Timers::UNUSED_ID;
+    m_stream->close();
+  });
+}
+
+void WS_stream::fail(uint16_t code)
+{
+  if (not m_closing) {
+    m_closing = true;
+    const uint8_t payload[2] = { uint8_t(code >> 8), uint8_t(code) };
+    send_frame(ws::CLOSE, payload, sizeof(payload));
+  }
+  m_close_code = code;
+  m_stream->close();
+}
+
+void WS_stream::stream_closed()
+{
+  m_closing = true;
+  if (m_close_timer != Timers::UNUSED_ID) {
+    Timers::stop(m_close_timer);
+    m_close_timer = Timers::UNUSED_ID;
+  }
+  // read_data() is still using this, and calls on_close when done
+  if (m_reading) {
+    m_closed = true;
+    return;
+  }
+  // may delete this
+  if (on_close) on_close(m_close_code);
+}
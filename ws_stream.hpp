@@ -0,0 +1,187 @@
+#pragma once
+#ifndef WS_STREAM_HPP
+#define WS_STREAM_HPP
+
+#include <net/stream.hpp>
+#include <delegate>
+#include <timers>
+#include <chrono>
+#include <memory>
+#include <string>
+#include "ws_frame.hpp"
+#include "ws_deflate.hpp"
+#include "ws_utf8.hpp"
+#include "gather_stream.hpp"
+
+/**
+ * A complete WebSocket message, TEXT or BINARY.
+**/
+struct WS_message
+{
+  using buffer_t = net::Stream::buffer_t;
+
+  WS_message(uint8_t opcode, buffer_t buffer)
+    : op(opcode), buf(std::move(buffer)) {}
+
+  const uint8_t* data() const noexcept { return buf->data(); }
+  size_t size() const noexcept { return buf->size(); }
+  std::string as_text() const { return std::string((const char*) data(), size()); }
+
+  uint8_t  op;
+  buffer_t buf;
+};
+using WS_message_ptr = std::unique_ptr<WS_message>;
+
+/**
+ * Part of a TEXT or BINARY message, as it arrives. @data points into
+ * @buf, the buffer it was received in, and stays valid as long as @buf
+ * is kept. Inflated pieces have no @buf and must be copied before the
+ * handler returns. The last chunk may be empty.
+**/
+struct WS_chunk
+{
+  using buffer_t = net::Stream::buffer_t;
+
+  uint8_t        op;
+  const uint8_t* data;
+  size_t         len;
+  bool           first;
+  bool           last;
+  buffer_t       buf;
+};
+
+/**
+ * The server side of a WebSocket connection, on any net::Stream,
+ * such as the TLS streams from TLS_SMP_server. Frames are parsed straight
+ * out of the buffers the stream delivers and unmasked in place. TEXT
+ * messages that are not valid UTF-8 fail the connection with 1007.
+ * With permessage-deflate, messages are compressed in both directions.
+ *
+ * With on_chunk set, messages are handed over in pieces as they arrive
+ * instead, without waiting for (or copying into) the whole message.
+ *
+ * Streams that implement Gather_stream, like the SMP TLS streams, are
+ * given the frame header and a buffer_t payload as two buffers, so the
+ * payload is never copied. Others get the frame in one buffer: the
+ * TCP stream sends every buffer written to it in segments of its own.
+ *
+ * on_read and on_chunk may close the stream, but only on_close may
+ * delete it. When they do close it, on_close follows once the data
+ * being read has been dealt with.
+**/
+class WS_stream
+{
+public:
+  using buffer_t      = net::Stream::buffer_t;
+  using Stream_ptr    = std::unique_ptr<net::Stream>;
+  using Read_handler  = delegate<void(WS_message_ptr)>;
+  using Close_handler = delegate<void(uint16_t)>;
+  using Chunk_handler = delegate<void(const WS_chunk&)>;
+
+  // largest message accepted from a client, by default
+  static const size_t MAX_MESSAGE = 16 * 1024 * 1024;
+  // what the stream underneath is asked to read at a time
+  static const size_t READ_SIZE = 16384;
+  // how long close() waits for the client to answer
+  static constexpr std::chrono::seconds CLOSE_TIMEOUT {10};
+
+  explicit WS_stream(Stream_ptr stream);
+  // with the permessage-deflate parameters agreed in the handshake
+  WS_stream(Stream_ptr stream, const ws::deflate_params& params,
+            const ws::deflate_options& options);
+  ~WS_stream();
+
+  Read_handler  on_read  = nullptr;
+  // when set, messages are streamed here instead of given to on_read
+  Chunk_handler on_chunk = nullptr;
+  // the connection is gone, with the close code we got (or 1006)
+  Close_handler on_close = nullptr;
+
+  void write(const void* data, size_t len, uint8_t op = ws::BINARY);
+  // the payload may be sent by reference: leave it unchanged afterwards
+  void write(buffer_t payload, uint8_t op = ws::BINARY);
+  void write(const std::string& text, uint8_t op = ws::TEXT)
+  {
+    this->write(text.data(), text.size(), op);
+  }
+
+  /** A complete, unmasked frame. Nothing is compressed here. */
+  static buffer_t encode_frame(uint8_t op, const void* data, size_t len, uint8_t rsv = 0);
+
+  /**
+   * Writes a frame from encode_frame() as it is. The same buffer can
+   * go to any number of streams.
+   */
+  void write_frame(buffer_t frame);
+
+  /**
+   * Start the closing handshake, the stream closes when the client
+   * answers, or after CLOSE_TIMEOUT when it does not
+   */
+  void close(uint16_t code = ws::NORMAL);
+
+  /** Messages larger than this fail the connection with 1009 */
+  void set_max_message(size_t size) noexcept { m_max_message = size; }
+  size_t max_message() const noexcept { return m_max_message; }
+
+  bool is_alive() const noexcept { return not m_closing; }
+
+  net::Stream& get_connection() noexcept { return *m_stream; }
+
+  std::string to_string() const { return m_stream->to_string(); }
+
+private:
+  friend class WS_broadcast;
+  void read_data(buffer_t);
+  void read_frames(buffer_t);
+  // false when no further frames should be processed
+  bool process_frame(const ws::frame_header&, uint8_t* payload);
+  bool valid_rsv(const ws::frame_header&) const noexcept;
+  void inflate_and_deliver(uint8_t op, const uint8_t* data, size_t len);
+  void deliver(uint8_t op, buffer_t);
+  // streaming: false when no further frames should be processed
+  bool begin_chunks(const ws::frame_header&);
+  bool stream_chunk(const uint8_t* data, size_t len, bool last, const buffer_t&);
+  bool emit_chunk(const uint8_t* data, size_t len, bool last, const buffer_t&);
+  void emit_inflated(const uint8_t* data, size_t len);
+  void send_frame(uint8_t op, const void* data, size_t len, uint8_t rsv = 0);
+  void fail(uint16_t code);
+  void stream_closed();
+
+  // ordered by size, this is kept for every connection
+  Stream_ptr m_stream;
+  // m_stream, when it takes scatter-gather writes
+  Gather_stream* m_gather = nullptr;
+  // start of a frame that has not fully arrived
+  buffer_t   m_partial = nullptr;
+  // fragments of a message
+  buffer_t   m_message = nullptr;
+  // permessage-deflate, when negotiated
+  std::unique_ptr<ws::deflater> m_deflater = nullptr;
+  std::unique_ptr<ws::inflater> m_inflater = nullptr;
+  size_t     m_max_message = MAX_MESSAGE;
+  // streaming: what is left of the data frame, and the message so far
+  uint64_t   m_frame_left = 0;
+  size_t     m_chunk_total = 0;
+  uint32_t   m_deflate_min = 0;
+  Timers::id_t m_close_timer = Timers::UNUSED_ID;
+  uint16_t   m_close_code = ws::ABNORMAL;
+  uint8_t    m_message_op = 0;
+  bool       m_message_deflated = false;
+  bool       m_closing = false;
+  // frames are being read, and whether the stream closed meanwhile
+  bool       m_reading = false;
+  bool       m_closed = false;
+  // the mask of the streamed frame, and where in it the next byte is
+  uint8_t    m_frame_mask[4];
+  uint8_t    m_frame_pos = 0;
+  bool       m_frame_fin = false;
+  // the message being streamed, op 0 when there is none
+  uint8_t    m_chunk_op = 0;
+  bool       m_chunk_first = false;
+  bool       m_chunk_deflated = false;
+  utf8_validator m_utf8;
+};
+using WS_stream_ptr = std::unique_ptr<WS_stream>;
+
+#endif
@@ -0,0 +1,292 @@
+#include "ws_utf8.hpp"
+#include "ws_mask.hpp"
+#include <algorithm>
+#include <cstring>
+#include <immintrin.h>
+
+bool utf8_valid_scalar(const uint8_t* data, size_t len)
+{
+  size_t i = 0;
+  while (i < len)
+  {
+    const uint8_t c = data[i];
+    if (c < 0x80) { i++; continue; }
+
+    size_t n;
+    uint8_t lo = 0x80, hi = 0xBF; // range of the second byte
+    if      (c >= 0xC2 && c <= 0xDF) n = 1;
+    else if (c == 0xE0) { n = 2; lo = 0xA0; }
+    else if (c == 0xED) { n = 2; hi = 0x9F; }
+    else if (c >= 0xE1 && c <= 0xEF) n = 2;
+    else if (c == 0xF0) { n = 3; lo = 0x90; }
+    else if (c == 0xF4) { n = 3; hi = 0x8F; }
+    else if (c >= 0xF1 && c <= 0xF3) n = 3;
+    else return false;
+
+    if (i + n >= len) return false;
+    if (data[i+1] < lo || data[i+1] > hi) return false;
+    for (size_t k = 2; k <= n; k++)
+      if ((data[i+k] & 0xC0) != 0x80) return false;
+    i += n + 1;
+  }
+  return true;
+}
+
+/**
+ * Each byte pair (previous, current) is classified by three 16-entry
+ * tables on the high nibble of the previous byte, its low nibble and the
+ * high nibble of the current byte. ANDing them leaves a bit set for each
+ * error that pair shows. Lengths of 3 and 4 byte sequences are checked
+ * separately, by comparing which bytes must be continuations.
+**/
+static const uint8_t TOO_SHORT   = 1 << 0;
+static const uint8_t TOO_LONG    = 1 << 1;
+static const uint8_t OVERLONG_3  = 1 << 2;
+static const uint8_t TOO_LARGE   = 1 << 3;
+static const uint8_t SURROGATE   = 1 << 4;
+static const uint8_t OVERLONG_2  = 1 << 5;
+static const uint8_t TOO_LARGE_1000 = 1 << 6;
+static const uint8_t OVERLONG_4  = 1 << 6;
+static const uint8_t TWO_CONTS   = 1 << 7;
+static const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+#define BYTE_1_HIGH \
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+  TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+  TOO_SHORT | OVERLONG_2, \
+  TOO_SHORT, \
+  TOO_SHORT | OVERLONG_3 | SURROGATE, \
+  TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW \
+  CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+  CARRY | OVERLONG_2, \
+  CARRY, \
+  CARRY, \
+  CARRY | TOO_LARGE, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000, \
+  CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE  | TOO_LARGE, \
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE  | TOO_LARGE, \
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+static const uint8_t table_1_high[16] = { BYTE_1_HIGH };
+static const uint8_t table_1_low[16]  = { BYTE_1_LOW };
+static const uint8_t table_2_high[16] = { BYTE_2_HIGH };
+
+/// SSE, 16 bytes at a time ///
+
+struct sse_state
+{
+  __m128i error = _mm_setzero_si128();
+  __m128i prev_input = _mm_setzero_si128();
+  __m128i prev_incomplete = _mm_setzero_si128();
+};
+
+static inline __m128i sse_high_nibbles(__m128i v)
+{
+  return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+}
+
+static inline void sse_check(sse_state& st, __m128i input)
+{
+  // nothing but ASCII: only a sequence cut off in the last block can fail
+  if (_mm_movemask_epi8(input) == 0) {
+    st.error = _mm_or_si128(st.error, st.prev_incomplete);
+    st.prev_incomplete = _mm_setzero_si128();
+    st.prev_input = input;
+    return;
+  }
+  const __m128i t1h = _mm_loadu_si128((const __m128i*) table_1_high);
+  const __m128i t1l = _mm_loadu_si128((const __m128i*) table_1_low);
+  const __m128i t2h = _mm_loadu_si128((const __m128i*) table_2_high);
+
+  const __m128i prev1 = _mm_alignr_epi8(input, st.prev_input, 15);
+  const __m128i sc = _mm_and_si128(
+      _mm_and_si128(_mm_shuffle_epi8(t1h, sse_high_nibbles(prev1)),
+                    _mm_shuffle_epi8(t1l, _mm_and_si128(prev1, _mm_set1_epi8(0x0F)))),
+      _mm_shuffle_epi8(t2h, sse_high_nibbles(input)));
+
+  const __m128i prev2 = _mm_alignr_epi8(input, st.prev_input, 14);
+  const __m128i prev3 = _mm_alignr_epi8(input, st.prev_input, 13);
+  // only 111_____ and 1111____ end up with the high bit set
+  const __m128i third  = _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0 - 0x80));
+  const __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0 - 0x80));
+  const __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(0x80));
+  st.error = _mm_or_si128(st.error, _mm_xor_si128(must23, sc));
+
+  // a lead byte in the last 3 positions needs bytes from the next block
+  const __m128i max_value = _mm_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      0xF0 - 1, 0xE0 - 1, 0xC0 - 1);
+  st.prev_incomplete = _mm_subs_epu8(input, max_value);
+  st.prev_input = input;
+}
+
+bool utf8_valid_sse(const uint8_t* data, size_t len)
+{
+  sse_state st;
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16)
+      sse_check(st, _mm_loadu_si128((const __m128i*) (data + i)));
+  if (i < len)
+  {
+    // pad with ASCII
+    uint8_t block[16] = {0};
+    std::memcpy(block, data + i, len - i);
+    sse_check(st, _mm_loadu_si128((const __m128i*) block));
+  }
+  st.error = _mm_or_si128(st.error, st.prev_incomplete);
+  return _mm_testz_si128(st.error, st.error);
+}
+
+/// AVX2, 32 bytes at a time ///
+
+struct avx2_state
+{
+  __m256i error;
+  __m256i prev_input;
+  __m256i prev_incomplete;
+};
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_prev(__m256i input, __m256i prev, int n)
+{
+  // the bytes before @input: upper half of @prev, lower half of @input
+  const __m256i shifted = _mm256_permute2x128_si256(prev, input, 0x21);
+  switch (n) {
+  case 1:  return _mm256_alignr_epi8(input, shifted, 15);
+  case 2:  return _mm256_alignr_epi8(input, shifted, 14);
+  default: return _mm256_alignr_epi8(input, shifted, 13);
+  }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_high_nibbles(__m256i v)
+{
+  return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_check(avx2_state& st, __m256i input)
+{
+  if (_mm256_movemask_epi8(input) == 0) {
+    st.error = _mm256_or_si256(st.error, st.prev_incomplete);
+    st.prev_incomplete = _mm256_setzero_si256();
+    st.prev_input = input;
+    return;
+  }
+  const __m256i t1h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) table_1_high));
+  const __m256i t1l = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) table_1_low));
+  const __m256i t2h = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) table_2_high));
+
+  const __m256i prev1 = avx2_prev(input, st.prev_input, 1);
+  const __m256i sc = _mm256_and_si256(
+      _mm256_and_si256(_mm256_shuffle_epi8(t1h, avx2_high_nibbles(prev1)),
+                       _mm256_shuffle_epi8(t1l, _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)))),
+      _mm256_shuffle_epi8(t2h, avx2_high_nibbles(input)));
+
+  const __m256i prev2 = avx2_prev(input, st.prev_input, 2);
+  const __m256i prev3 = avx2_prev(input, st.prev_input, 3);
+  const __m256i third  = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80));
+  const __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80));
+  const __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8(0x80));
+  st.error = _mm256_or_si256(st.error, _mm256_xor_si256(must23, sc));
+
+  const __m256i max_value = _mm256_setr_epi8(
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      0xF0 - 1, 0xE0 - 1, 0xC0 - 1);
+  st.prev_incomplete = _mm256_subs_epu8(input, max_value);
+  st.prev_input = input;
+}
+
+__attribute__((target("avx2")))
+bool utf8_valid_avx2(const uint8_t* data, size_t len)
+{
+  avx2_state st;
+  st.error = _mm256_setzero_si256();
+  st.prev_input = _mm256_setzero_si256();
+  st.prev_incomplete = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+      avx2_check(st, _mm256_loadu_si256((const __m256i*) (data + i)));
+  if (i < len)
+  {
+    uint8_t block[32] = {0};
+    std::memcpy(block, data + i, len - i);
+    avx2_check(st, _mm256_loadu_si256((const __m256i*) block));
+  }
+  st.error = _mm256_or_si256(st.error, st.prev_incomplete);
+  return _mm256_testz_si256(st.error, st.error);
+}
+
+using utf8_func = bool(*)(const uint8_t*, size_t);
+static const utf8_func kernel = ws_mask_has_avx2() ? &utf8_valid_avx2 : &utf8_valid_sse;
+
+bool utf8_valid(const uint8_t* data, size_t len)
+{
+  return kernel(data, len);
+}
+
+const char* utf8_kernel() noexcept
+{
+  return (kernel == &utf8_valid_avx2) ? "AVX2" : "SSE4";
+}
+
+// length of the sequence @lead starts, 0 for anything that is no lead
+static inline size_t sequence_length(uint8_t lead)
+{
+  if (lead < 0x80) return 1;
+  if (lead < 0xC0) return 0;
+  if (lead < 0xE0) return 2;
+  if (lead < 0xF0) return 3;
+  return 4;
+}
+
+bool utf8_validator::feed(const uint8_t* data, size_t len)
+{
+  if (len == 0) return true;
+  if (m_carry_len > 0)
+  {
+    // complete the sequence held back last time
+    const size_t need = sequence_length(m_carry[0]);
+    const size_t n = std::min(need - m_carry_len, len);
+    std::memcpy(m_carry + m_carry_len, data, n);
+    m_carry_len += n;
+    data += n;
+    len  -= n;
+    if (m_carry_len < need) return true;
+    if (not utf8_valid(m_carry, m_carry_len)) return false;
+    m_carry_len = 0;
+  }
+  // a lead byte among the last 3 may need the next piece
+  size_t tail = 0;
+  for (size_t k = 1; k <= 3 && k <= len; k++)
+  {
+    const uint8_t c = data[len - k];
+    if ((c & 0xC0) == 0x80) continue;
+    if (sequence_length(c) > k) tail = k;
+    break;
+  }
+  if (not utf8_valid(data, len - tail)) return false;
+  std::memcpy(m_carry, data + len - tail, tail);
+  m_carry_len = tail;
+  return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#ifndef WS_UTF8_HPP
+#define WS_UTF8_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Whether @data is well-formed UTF-8 (RFC 3629): no overlong forms,
+ * no surrogates, nothing above U+10FFFF and no truncated sequence at
+ * the end. TEXT messages must pass this (RFC 6455 8.1).
+ *
+ * Uses the vectorized lookup algorithm of Keiser and Lemire, with the
+ * widest kernel the CPU supports, chosen once at startup.
+**/
+bool utf8_valid(const uint8_t* data, size_t len);
+
+// the individual kernels, for testing and benchmarking
+bool utf8_valid_scalar(const uint8_t* data, size_t len);
+bool utf8_valid_sse(const uint8_t* data, size_t len);
+bool utf8_valid_avx2(const uint8_t* data, size_t len);
+
+// name of the kernel utf8_valid() uses
+const char* utf8_kernel() noexcept;
+
+/**
+ * Validates text that arrives in pieces, split anywhere. A sequence cut
+ * at the end of a piece is held back (at most 3 bytes) and checked once
+ * the next piece completes it.
+**/
+class utf8_validator
+{
+public:
+  /** false as soon as the text so far cannot be valid */
+  bool feed(const uint8_t* data, size_t len);
+  /** Whether the text ended on a whole character */
+  bool finish() const noexcept { return m_carry_len == 0; }
+  void reset() noexcept { m_carry_len = 0; }
+
+private:
+  uint8_t m_carry[4];
+  uint8_t m_carry_len = 0;
+};
+
+#endif